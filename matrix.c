@@ -2,7 +2,10 @@
 #include <_ansi.h>
 #undef _STRICT_ANSI
 #endif
+#include <float.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -11,6 +14,36 @@
 
 #include "matrix_config.h"
 
+#if defined(MATRIX_ENABLE_ASYNC) && (defined(__EPOC32__) || !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 503)
+#  undef MATRIX_ENABLE_ASYNC // needs POSIX threads and lua_yieldk
+#endif
+#if defined(MATRIX_ENABLE_SHARE) && defined(__EPOC32__)
+#  undef MATRIX_ENABLE_SHARE // needs POSIX threads
+#endif
+#if defined(MATRIX_ENABLE_TILED) && (defined(__EPOC32__) || defined(_WIN32))
+#  undef MATRIX_ENABLE_TILED // needs mmap
+#endif
+#if defined(MATRIX_ENABLE_ASYNC) || defined(MATRIX_ENABLE_TILED)
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#  include <stdatomic.h>
+#  define MATRIX_ATOMICS
+#endif
+#if defined(MATRIX_ENABLE_ASYNC) || defined(MATRIX_ENABLE_SHARE)
+#  include <pthread.h>
+#  include <stdatomic.h>
+#endif
+#ifdef MATRIX_ENABLE_SHARE
+#  include <stdio.h>
+#endif
+#ifdef MATRIX_ENABLE_TILED
+#  include <errno.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
 /**
  * m = matrix.new{3, 2, value=2}  or  matrix.new(3, 2)
  * m = matrix.id(3)
@@ -26,18 +59,298 @@
 
 #define MATRIX_MAX_TOSTRING 200
 
-static struct Matrix * push_matrix(lua_State * L, int rows, int cols) {
-    struct Matrix * m = (struct Matrix *) lua_newuserdata(L, sizeof (struct Matrix) + sizeof (MATRIX_TYPE[rows*cols]));
+// lua_pushfstring format for sizes and indices (luaL_error messages), %I is only known since 5.3
+#if LUA_VERSION_NUM >= 503
+#  define MATRIX_SIZE_FMT "%I"
+#  define matrix_size_arg(x) ((lua_Integer)(x))
+#else
+#  define MATRIX_SIZE_FMT "%d"
+#  define matrix_size_arg(x) ((int)(x))
+#endif
+// snprintf format for whole lua_Integer values, from luaconf.h since 5.3 (ptrdiff_t before)
+#ifndef LUA_INTEGER_FMT
+#  define LUA_INTEGER_FMT "%td"
+#endif
+#ifndef LUAI_UACINT
+#  define LUAI_UACINT lua_Integer
+#endif
+
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 501 
+static int lua_absindex (lua_State *L, int i) { 
+    if (i < 0 && i > LUA_REGISTRYINDEX) 
+        i += lua_gettop(L) + 1; 
+    return i; 
+} 
+#define lua_setuservalue lua_setfenv
+#define lua_getuservalue lua_getfenv
+#endif
+
+#if defined( LUA_VERSION_NUM ) && LUA_VERSION_NUM <= 502 
+static int lua_geti (lua_State *L, int index, lua_Integer i) { 
+    index = lua_absindex(L, index); 
+    lua_pushinteger(L, i); 
+    lua_gettable(L, index); 
+    return lua_type(L, -1); 
+} 
+#endif
+
+// bound for the number of elements of matrices, masks and indices, so that byte sizes never overflow
+#define MATRIX_MAX_ELEMENTS ((matrix_size_t)((PTRDIFF_MAX - sizeof (struct Matrix)) / sizeof (MATRIX_TYPE)))
+
+// rows*cols, raising an error for negative sizes or products above MATRIX_MAX_ELEMENTS
+static matrix_size_t matrix_checksize(lua_State * L, matrix_size_t rows, matrix_size_t cols) {
+    if (rows < 0 || cols < 0 || (cols > 0 && rows > MATRIX_MAX_ELEMENTS / cols))
+        luaL_error(L, "invalid size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT ", too big", matrix_size_arg(rows), matrix_size_arg(cols));
+    return rows * cols;
+}
+
+static struct Matrix * push_matrix(lua_State * L, matrix_size_t rows, matrix_size_t cols) {
+    matrix_size_t size = matrix_checksize(L, rows, cols);
+    struct Matrix * m = (struct Matrix *) lua_newuserdata(L, sizeof (struct Matrix) + sizeof (MATRIX_TYPE[size]));
     m->rows = rows;
     m->cols = cols;
+    m->d = m->storage;
+    m->shared = NULL;
+    m->owner = NULL;
+    m->refs = 1;
+    luaL_setmetatable(L, MATRIX_MT);
+    return m;
+}
+
+#ifdef MATRIX_ENABLE_COW
+/**
+ * Copy on write: copies and slices spanning whole columns are headers pointing into the storage
+ * of another matrix (their owner), which they keep referenced through their user value. Every
+ * matrix counts in refs how many of them use its storage, itself included while it does.
+ * Writing to a matrix whose storage holder has other users first moves its content to a new
+ * (hidden) owner, so the others keep seeing the old values.
+ */
+#if LUA_VERSION_NUM >= 503
+#  define matrix_setowner(L, idx) lua_setuservalue(L, idx)
+#  define matrix_pushowner(L, idx) lua_getuservalue(L, idx)
+#else // user values must be tables
+static void matrix_setowner(lua_State * L, int idx) {
+    lua_createtable(L, 1, 0);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, idx);
+}
+static void matrix_pushowner(lua_State * L, int idx) {
+    lua_getuservalue(L, idx);
+    if (lua_istable(L, -1)) lua_rawgeti(L, -1, 1); else lua_pushnil(L);
+    lua_remove(L, -2);
+}
+#endif
+
+// matrix whose storage m's elements live in, NULL for shared buffers
+#define matrix_holder(m) ((m)->owner ? (m)->owner : (m)->shared ? NULL : (m))
+
+// m (at idx) stops using its current storage, leaving d to be set by the caller
+static void matrix_release_storage(lua_State * L, int idx) {
+    struct Matrix * m = (struct Matrix*)lua_touserdata(L, idx);
+    struct Matrix * holder = matrix_holder(m);
+    if (holder) holder->refs--;
+    if (m->owner) {
+        m->owner = NULL;
+        lua_pushnil(L);
+        matrix_setowner(L, idx);
+    }
+}
+
+/**
+ * pushes a rows*cols matrix with the elements starting at m->d + offset (m at idx), sharing
+ * them until either of the two matrices is written
+ */
+static struct Matrix * push_matrix_cow(lua_State * L, int idx, matrix_size_t rows, matrix_size_t cols, matrix_size_t offset) {
+    struct Matrix * m = (struct Matrix*)lua_touserdata(L, idx);
+    struct Matrix * holder = matrix_holder(m);
+    if (!holder) { // buffers shared between lua_States are always copied
+        struct Matrix * dest = push_matrix(L, rows, cols);
+        memcpy(dest->d, m->d + offset, sizeof (MATRIX_TYPE[rows*cols]));
+        return dest;
+    }
+    idx = lua_absindex(L, idx);
+    struct Matrix * c = (struct Matrix *) lua_newuserdata(L, sizeof (struct Matrix));
+    c->rows = rows;
+    c->cols = cols;
+    c->d = m->d + offset;
+    c->shared = NULL;
+    c->owner = holder;
+    c->refs = 0;
+    luaL_setmetatable(L, MATRIX_MT);
+    if (holder == m) lua_pushvalue(L, idx); else matrix_pushowner(L, idx);
+    matrix_setowner(L, -2);
+    holder->refs++;
+    return c;
+}
+#else
+#define matrix_release_storage(L, idx) ((void)0)
+static struct Matrix * push_matrix_cow(lua_State * L, int idx, matrix_size_t rows, matrix_size_t cols, matrix_size_t offset) {
+    struct Matrix * m = (struct Matrix*)lua_touserdata(L, idx);
+    struct Matrix * dest = push_matrix(L, rows, cols);
+    memcpy(dest->d, m->d + offset, sizeof (MATRIX_TYPE[rows*cols]));
+    return dest;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_SHARE
+/**
+ * m = matrix.new{h, w, shared=true}
+ * token = m:share(readonly)
+ * m = matrix.adopt(token)
+ *
+ * Buffers shared between lua_States (of any thread in the process) are malloc'ed and reference
+ * counted, every adopting matrix being just a header pointing to them. Live buffers are kept in a
+ * process wide list, so that a token (an integer) can be adopted as long as some matrix still
+ * references its buffer. Read-only buffers can never be written again, so no locking is needed
+ * to read them concurrently. Regular matrices have their elements inside the userdata, which
+ * can't be released: sharing one copies them to a buffer and leaves its storage unused, so
+ * matrices meant to be shared are better created as headers over a buffer from the start.
+ */
+struct MatrixShared {
+    struct MatrixShared * next;
+    lua_Integer token;
+    int refs;               // protected by matrix_shared_lock
+    atomic_int readonly;    // only ever set, read by any thread without locking
+    matrix_size_t rows, cols;
+    MATRIX_TYPE d[];
+};
+
+static pthread_mutex_t matrix_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct MatrixShared * matrix_shared_list;
+static lua_Integer matrix_shared_last_token;
+
+static void matrix_shared_release(struct MatrixShared * buf) {
+    pthread_mutex_lock(&matrix_shared_lock);
+    if (--buf->refs == 0) {
+        struct MatrixShared ** cursor = &matrix_shared_list;
+        while (*cursor != buf) cursor = &(*cursor)->next;
+        *cursor = buf->next;
+        free(buf);
+    }
+    pthread_mutex_unlock(&matrix_shared_lock);
+}
+
+// new buffer of rows*cols elements (uninitialized), with a reference and a token
+static struct MatrixShared * matrix_shared_new(lua_State * L, matrix_size_t rows, matrix_size_t cols) {
+    struct MatrixShared * buf = malloc(sizeof (struct MatrixShared) + sizeof (MATRIX_TYPE[matrix_checksize(L, rows, cols)]));
+    if (!buf) luaL_error(L, "not enough memory to share a " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix", matrix_size_arg(rows), matrix_size_arg(cols));
+    buf->refs = 1;
+    atomic_init(&buf->readonly, 0);
+    buf->rows = rows;
+    buf->cols = cols;
+    pthread_mutex_lock(&matrix_shared_lock);
+    buf->token = ++matrix_shared_last_token;
+    buf->next = matrix_shared_list;
+    matrix_shared_list = buf;
+    pthread_mutex_unlock(&matrix_shared_lock);
+    return buf;
+}
+
+// pushes a matrix header (without storage) to be pointed at a shared buffer
+static struct Matrix * push_matrix_header(lua_State * L) {
+    struct Matrix * m = (struct Matrix *) lua_newuserdata(L, sizeof (struct Matrix));
+    m->rows = m->cols = 0;
+    m->d = NULL;
+    m->shared = NULL;
+    m->owner = NULL;
+    m->refs = 0;
     luaL_setmetatable(L, MATRIX_MT);
     return m;
 }
 
+// pushes a rows*cols matrix whose elements are in a new shared buffer (see matrix.new)
+static struct Matrix * push_matrix_shared(lua_State * L, matrix_size_t rows, matrix_size_t cols) {
+    struct Matrix * m = push_matrix_header(L);
+    m->shared = matrix_shared_new(L, rows, cols);
+    m->rows = rows;
+    m->cols = cols;
+    m->d = m->shared->d;
+    return m;
+}
+
+static int matrix_mt_share(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    int readonly = lua_toboolean(L, 2);
+    if (!m->shared) {
+        // first time: the content is copied to a new buffer, the userdata's storage stays unused
+        // (m keeps its elements, and its copy on write owner, if allocating the buffer fails)
+        struct MatrixShared * buf = matrix_shared_new(L, m->rows, m->cols);
+        memcpy(buf->d, m->d, sizeof (MATRIX_TYPE[m->rows * m->cols]));
+        matrix_release_storage(L, 1);
+        m->shared = buf;
+        m->d = buf->d;
+    }
+    if (readonly) atomic_store(&m->shared->readonly, 1);
+    lua_pushinteger(L, m->shared->token);
+    return 1;
+}
+
+static int matrix_adopt(lua_State * L) {
+    lua_Integer token = luaL_checkinteger(L, 1);
+    struct MatrixShared * buf;
+    struct Matrix * m = push_matrix_header(L);
+    pthread_mutex_lock(&matrix_shared_lock);
+    for (buf = matrix_shared_list; buf && buf->token != token; buf = buf->next);
+    if (buf) buf->refs++;
+    pthread_mutex_unlock(&matrix_shared_lock);
+    if (!buf) {
+        char name[32]; // lua_pushfstring has no format for whole lua_Integers before 5.3
+        snprintf(name, sizeof name, LUA_INTEGER_FMT, (LUAI_UACINT)token);
+        return luaL_error(L, "unknown shared matrix token %s", name);
+    }
+    m->rows = buf->rows;
+    m->cols = buf->cols;
+    m->d = buf->d;
+    m->shared = buf;
+    return 1;
+}
+
+// whether the matrix can not be written, read from lua as m.readonly
+#define matrix_isreadonly(m) ((m)->shared && atomic_load(&(m)->shared->readonly))
+#else
+#define matrix_isreadonly(m) 0
+#endif
+
+#if defined(MATRIX_ENABLE_SHARE) || defined(MATRIX_ENABLE_COW)
+static int matrix_mt__gc(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+#ifdef MATRIX_ENABLE_COW
+    if (m->owner) m->owner->refs--; // still alive, referenced from m's user value
+    m->owner = NULL;
+#endif
+#ifdef MATRIX_ENABLE_SHARE
+    if (m->shared) matrix_shared_release(m->shared);
+    m->shared = NULL;
+#endif
+    return 0;
+}
+#endif
+
+// checks that the matrix at idx can be modified, getting its own copy of the elements if needed
+static struct Matrix * matrix_checkwritable(lua_State * L, int idx) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, idx, MATRIX_MT);
+    if (matrix_isreadonly(m)) luaL_error(L, "read-only matrix");
+#ifdef MATRIX_ENABLE_COW
+    struct Matrix * holder = matrix_holder(m);
+    if (holder && holder->refs > 1) {
+        idx = lua_absindex(L, idx);
+        struct Matrix * o = push_matrix(L, m->rows, m->cols); // hidden owner, only used by m
+        memcpy(o->d, m->d, sizeof (MATRIX_TYPE[m->rows * m->cols]));
+        matrix_release_storage(L, idx);
+        m->d = o->d;
+        m->owner = o;
+        matrix_setowner(L, idx); // pops o
+    }
+#endif
+    return m;
+}
+
 static int matrix_new(lua_State * L) {
     struct Matrix * m;
-    int rows, cols, i;
+    matrix_size_t rows, cols, i;
     MATRIX_TYPE value = 0;
+    int shared = 0;
     if (lua_isnumber(L, 1)) {
         // rows, cols = checkinteger(arg1), checkinteger(arg2):
         rows = luaL_checkinteger(L, 1);
@@ -54,15 +367,27 @@ static int matrix_new(lua_State * L) {
         // value = arg1.value or 0
         lua_getfield(L, 1, "value");
         value = luaL_optnumber(L, -1, value);
+        // shared = arg1.shared (elements in a buffer for m:share, instead of the userdata)
+        lua_getfield(L, 1, "shared");
+        shared = lua_toboolean(L, -1);
     }
-    if (rows < 1 || cols < 1) return luaL_error(L, "invalid size %d*%d", rows, cols);
+    if (rows < 1 || cols < 1) return luaL_error(L, "invalid size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(rows), matrix_size_arg(cols));
+#ifdef MATRIX_ENABLE_SHARE
+    if (shared) {
+        m = push_matrix_shared(L, rows, cols);
+    } else {
+        m = push_matrix(L, rows, cols);
+    }
+#else
+    (void)shared;
     m = push_matrix(L, rows, cols);
+#endif
     for (i = 0; i < rows*cols; i++) m->d[i] = value;
     return 1;
 }
 
-struct Matrix * push_id_matrix(lua_State * L, int side) {
-    int i, size = side * side;
+struct Matrix * push_id_matrix(lua_State * L, matrix_size_t side) {
+    matrix_size_t i, size = side * side;
     struct Matrix * m = push_matrix(L, side, side);
     for (i = 0; i < size; i++) m->d[i] = 0;
     for (i = 0; i < size; i += side + 1) m->d[i] = 1;
@@ -70,19 +395,19 @@ struct Matrix * push_id_matrix(lua_State * L, int side) {
 }
 
 static int matrix_id(lua_State * L) {
-    int side = luaL_checkinteger(L, 1);
-    if (side < 1) return luaL_error(L, "invalid size %d*%d", side);
+    matrix_size_t side = luaL_checkinteger(L, 1);
+    if (side < 1) return luaL_error(L, "invalid size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(side), matrix_size_arg(side));
     push_id_matrix(L, side);
     return 1;
 }
 
 static int matrix_random(lua_State * L) {
     struct Matrix * m;
-    int rows, cols, i;
+    matrix_size_t rows, cols, i;
     MATRIX_TYPE factor = 1.0 / ((MATRIX_TYPE)RAND_MAX + 1.0);
     rows = luaL_checkinteger(L, 1);
     cols = luaL_checkinteger(L, 2);
-    if (rows < 1 || cols < 1) return luaL_error(L, "invalid size %d*%d", rows, cols);
+    if (rows < 1 || cols < 1) return luaL_error(L, "invalid size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(rows), matrix_size_arg(cols));
     m = push_matrix(L, rows, cols);
 #ifdef LUA_USE_POSIX
     for (i = 0; i < rows*cols; i++) m->d[i] = factor * (MATRIX_TYPE)random();
@@ -92,34 +417,180 @@ static int matrix_random(lua_State * L) {
     return 1;
 }
 
-#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM == 501 
-static int lua_absindex (lua_State *L, int i) { 
-    if (i < 0 && i > LUA_REGISTRYINDEX) 
-        i += lua_gettop(L) + 1; 
-    return i; 
-} 
+#ifdef MATRIX_ENABLE_RNG
+/**
+ * r = matrix.rng(seed, stream)
+ * m = r:uniform(h, w, lo, hi)  or  r:uniform(m, lo, hi)  -- the later fills m in place
+ * m = r:normal(h, w, mean, sd)
+ * m = r:bernoulli(h, w, p)
+ * m = r:randint(h, w, lo, hi)
+ *
+ * Counter based generator: the k-th word of a stream is mix(key + k*GOLDEN), where mix is
+ * the splitmix64 finalizer. Every element only depends on its position, so fills can be
+ * split between threads without changing the result.
+ */
+#define MATRIX_RNG_MT CAT_MATRIX_STR(MATRIX_TYPE) " rng"
+#define MATRIX_RNG_GOLDEN 0x9e3779b97f4a7c15ULL
+
+struct MatrixRng {
+    uint64_t key;
+    uint64_t counter; // words already consumed from the stream
+};
+
+static uint64_t matrix_rng_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+#define matrix_rng_word(r, k) matrix_rng_mix((r)->key + ((r)->counter + (uint64_t)(k)) * MATRIX_RNG_GOLDEN)
+// uniform in [0, 1) using as many bits as the mantissa can hold:
+#if defined(MATRIX_TYPE_FLOAT)
+#  define matrix_rng_unit(x) ((MATRIX_TYPE)((x) >> 40) * (1.0f / 16777216.0f))
+#else
+#  define matrix_rng_unit(x) ((MATRIX_TYPE)((x) >> 11) * (1.0 / 9007199254740992.0))
 #endif
 
-#if defined( LUA_VERSION_NUM ) && LUA_VERSION_NUM <= 502 
-static int lua_geti (lua_State *L, int index, lua_Integer i) { 
-    index = lua_absindex(L, index); 
-    lua_pushinteger(L, i); 
-    lua_gettable(L, index); 
-    return lua_type(L, -1); 
-} 
+static struct MatrixRng * push_rng(lua_State * L, uint64_t key) {
+    struct MatrixRng * r = (struct MatrixRng *) lua_newuserdata(L, sizeof (struct MatrixRng));
+    r->key = key;
+    r->counter = 0;
+    luaL_setmetatable(L, MATRIX_RNG_MT);
+    return r;
+}
+
+static uint64_t matrix_rng_key(uint64_t seed, uint64_t stream) {
+    return matrix_rng_mix(matrix_rng_mix(seed) + (stream + 1) * 0xd1b54a32d192ed03ULL);
+}
+
+static int matrix_rng(lua_State * L) {
+    lua_Integer seed = luaL_optinteger(L, 1, 0);
+    lua_Integer stream = luaL_optinteger(L, 2, 0);
+    push_rng(L, matrix_rng_key(seed, stream));
+    return 1;
+}
+
+// r:stream(i) returns an independent generator, deterministic on r's key and i
+static int matrix_rng_stream(lua_State * L) {
+    struct MatrixRng * r = (struct MatrixRng*)luaL_checkudata(L, 1, MATRIX_RNG_MT);
+    push_rng(L, matrix_rng_key(r->key, luaL_checkinteger(L, 2)));
+    return 1;
+}
+
+// r:skip(n) advances the stream as if n words had been drawn
+static int matrix_rng_skip(lua_State * L) {
+    struct MatrixRng * r = (struct MatrixRng*)luaL_checkudata(L, 1, MATRIX_RNG_MT);
+    r->counter += (uint64_t)luaL_checkinteger(L, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/**
+ * pushes the destination matrix for the fill methods: either r:fn(m, ...) or r:fn(h, w, ...),
+ * storing into *nextarg the index of the first optional parameter.
+ */
+static struct Matrix * matrix_rng_target(lua_State * L, int * nextarg) {
+    lua_settop(L, 5); // keep the optional parameters below the pushed matrix
+    if (lua_isnumber(L, 2)) {
+        matrix_size_t rows = luaL_checkinteger(L, 2);
+        matrix_size_t cols = luaL_checkinteger(L, 3);
+        if (rows < 1 || cols < 1) luaL_error(L, "invalid size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(rows), matrix_size_arg(cols));
+        *nextarg = 4;
+        return push_matrix(L, rows, cols);
+    }
+    struct Matrix * m = matrix_checkwritable(L, 2);
+    *nextarg = 3;
+    lua_pushvalue(L, 2);
+    return m;
+}
+
+static int matrix_rng_uniform(lua_State * L) {
+    struct MatrixRng * r = (struct MatrixRng*)luaL_checkudata(L, 1, MATRIX_RNG_MT);
+    matrix_size_t i, size;
+    int arg;
+    struct Matrix * m = matrix_rng_target(L, &arg);
+    MATRIX_TYPE lo = luaL_optnumber(L, arg, 0);
+    MATRIX_TYPE width = luaL_optnumber(L, arg + 1, 1) - lo;
+    size = m->rows * m->cols;
+#ifdef _OPENMP
+#pragma omp parallel for if (size >= MATRIX_RNG_PARALLEL_MIN)
+#endif
+    for (i = 0; i < size; i++) m->d[i] = lo + width * matrix_rng_unit(matrix_rng_word(r, i));
+    r->counter += size;
+    return 1;
+}
+
+static int matrix_rng_normal(lua_State * L) {
+    struct MatrixRng * r = (struct MatrixRng*)luaL_checkudata(L, 1, MATRIX_RNG_MT);
+    matrix_size_t i, size;
+    int arg;
+    struct Matrix * m = matrix_rng_target(L, &arg);
+    double mean = luaL_optnumber(L, arg, 0);
+    double sd = luaL_optnumber(L, arg + 1, 1);
+    size = m->rows * m->cols;
+    // Box-Muller: words 2k and 2k+1 produce elements 2k and 2k+1
+#ifdef _OPENMP
+#pragma omp parallel for if (size >= MATRIX_RNG_PARALLEL_MIN)
+#endif
+    for (i = 0; i < size; i += 2) {
+        double u1 = ((matrix_rng_word(r, i) >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+        double u2 = (matrix_rng_word(r, i + 1) >> 11) * (1.0 / 9007199254740992.0);
+        double rad = sd * sqrt(-2.0 * log(u1));
+        m->d[i] = mean + rad * cos(6.283185307179586 * u2);
+        if (i + 1 < size) m->d[i+1] = mean + rad * sin(6.283185307179586 * u2);
+    }
+    r->counter += size + (size & 1);
+    return 1;
+}
+
+static int matrix_rng_bernoulli(lua_State * L) {
+    struct MatrixRng * r = (struct MatrixRng*)luaL_checkudata(L, 1, MATRIX_RNG_MT);
+    matrix_size_t i, size;
+    int arg;
+    struct Matrix * m = matrix_rng_target(L, &arg);
+    MATRIX_TYPE p = luaL_optnumber(L, arg, 0.5);
+    size = m->rows * m->cols;
+#ifdef _OPENMP
+#pragma omp parallel for if (size >= MATRIX_RNG_PARALLEL_MIN)
+#endif
+    for (i = 0; i < size; i++) m->d[i] = matrix_rng_unit(matrix_rng_word(r, i)) < p;
+    r->counter += size;
+    return 1;
+}
+
+static int matrix_rng_randint(lua_State * L) {
+    struct MatrixRng * r = (struct MatrixRng*)luaL_checkudata(L, 1, MATRIX_RNG_MT);
+    matrix_size_t i, size;
+    int arg;
+    struct Matrix * m = matrix_rng_target(L, &arg);
+    lua_Integer lo = luaL_checkinteger(L, arg);
+    lua_Integer hi = luaL_checkinteger(L, arg + 1);
+    // hi - lo may overflow lua_Integer, so the width is computed on unsigned values once ordered
+    if (hi < lo || (uint64_t)hi - (uint64_t)lo >= 0x100000000ULL)
+        return luaL_error(L, "invalid randint range");
+    uint64_t range = (uint64_t)hi - (uint64_t)lo + 1;
+    size = m->rows * m->cols;
+    // multiply-shift maps the upper 32 bits of each word into [0, range)
+#ifdef _OPENMP
+#pragma omp parallel for if (size >= MATRIX_RNG_PARALLEL_MIN)
+#endif
+    for (i = 0; i < size; i++) m->d[i] = lo + (lua_Integer)(((matrix_rng_word(r, i) >> 32) * range) >> 32);
+    r->counter += size;
+    return 1;
+}
 #endif
 
 
 static int matrix_fromtable(lua_State * L) {
     struct Matrix * m;
-    int rows, cols, i;
+    matrix_size_t rows, cols, i;
     if (!lua_istable(L, 1)) return luaL_error(L, "fromtable requires a table");
     lua_getfield(L, 1, "rows");
     rows = luaL_optinteger(L, -1, 1);
     lua_getfield(L, 1, "cols");
     cols = luaL_optinteger(L, -1, 1);
     lua_len(L, 1);
-    if (luaL_checkinteger(L, -1) != rows * cols)
+    if (luaL_checkinteger(L, -1) != matrix_checksize(L, rows, cols))
         return luaL_error(L, "#t must be equal to t.cols*t.rows");
     m = push_matrix(L, rows, cols);
     for (i = 0; i < rows*cols; i++) {
@@ -130,34 +601,51 @@ static int matrix_fromtable(lua_State * L) {
     return 1;
 }
 
-static int matrix_mt__index(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    if (lua_type(L, 2) == LUA_TSTRING && lua_getmetatable(L, 1)) {
-        const char * key = lua_tostring(L, 2);
-        if (!strcmp(key, "cols")) {
-            lua_pushinteger(L, m->cols);
-            return 1;
-        } else if (!strcmp(key, "rows")) {
-            lua_pushinteger(L, m->rows);
-            return 1;
-        }
-        lua_pushvalue(L, 2); // stack: {m, key, ..., mt} -> {m, key, ..., mt, key}
-        lua_rawget(L, -2); // stack -> {m, key, ..., rawget(mt, key)}
-        if (!lua_isnil(L, -1)) return 1;
-        return luaL_error(L, "method %s not available in metatable", key);
-    }
-    if (lua_isnumber(L, 2)) {
-        int idx = luaL_checkinteger(L, 2);
-        if (idx < 1 || idx > m->rows * m->cols) return luaL_error(L, "index out of bounds: %d", idx);
-        lua_pushnumber(L, m->d[idx-1]);
-    } else if (lua_istable(L, 2)) { // stride support {rows, cols}, where they can be nil, a number or {from, to}
-        int dim, row1, rown, col1, coln;
-        int point = 0;
+/**
+ * s = matrix.slice(r1, r2, c1, c2)
+ *
+ * Slices decoded once, usable instead of {{r1, r2}, {c1, c2}} tables wherever matrices are
+ * indexed. Missing bounds (nil) stand for the first row/column or the last one of the matrix the
+ * slice is applied to.
+ */
+#define MATRIX_SLICE_MT CAT_MATRIX_STR(MATRIX_TYPE) " slice"
+
+struct MatrixSlice {
+    matrix_size_t r1, r2, c1, c2; // 0 for the last row/column
+};
+
+static int matrix_slice(lua_State * L) {
+    lua_settop(L, 4);
+    struct MatrixSlice * s = (struct MatrixSlice *) lua_newuserdata(L, sizeof (struct MatrixSlice));
+    s->r1 = luaL_optinteger(L, 1, 1);
+    s->r2 = luaL_optinteger(L, 2, 0);
+    s->c1 = luaL_optinteger(L, 3, 1);
+    s->c2 = luaL_optinteger(L, 4, 0);
+    if (s->r1 < 1 || s->c1 < 1 || s->r2 < 0 || s->c2 < 0)
+        return luaL_error(L, "invalid slice {" MATRIX_SIZE_FMT ".." MATRIX_SIZE_FMT ", " MATRIX_SIZE_FMT ".." MATRIX_SIZE_FMT "}", matrix_size_arg(s->r1), matrix_size_arg(s->r2), matrix_size_arg(s->c1), matrix_size_arg(s->c2));
+    luaL_setmetatable(L, MATRIX_SLICE_MT);
+    return 1;
+}
+
+/**
+ * decodes the slice at idx for a rows*cols matrix: either a slice object or a {rows, cols} table, where each one
+ * can be nil (all of them), a number or {from, to}. Returns the number of dimensions given as a
+ * single number (2 for {row, col}, which stands for an element).
+ */
+static int matrix_checkslice(lua_State * L, int idx, matrix_size_t rows, matrix_size_t cols, matrix_size_t * row1, matrix_size_t * rown, matrix_size_t * col1, matrix_size_t * coln) {
+    int point = 0;
+    if (lua_isuserdata(L, idx)) {
+        const struct MatrixSlice * s = (const struct MatrixSlice *)luaL_checkudata(L, idx, MATRIX_SLICE_MT);
+        *row1 = s->r1;
+        *rown = s->r2 ? s->r2 : rows;
+        *col1 = s->c1;
+        *coln = s->c2 ? s->c2 : cols;
+    } else {
+        int dim, top = lua_gettop(L);
         for (dim = 1; dim <= 2; dim++) {
-            int * v1, * vn, n;
-            if (dim == 1) { v1=&row1; vn=&rown; n=m->rows; } else { v1=&col1; vn=&coln; n=m->cols; }
-            lua_pushinteger(L, dim);
-            lua_gettable(L, 2);
+            matrix_size_t * v1, * vn, n;
+            if (dim == 1) { v1=row1; vn=rown; n=rows; } else { v1=col1; vn=coln; n=cols; }
+            lua_rawgeti(L, idx, dim);
             switch (lua_type(L, -1)) {
                 case LUA_TNIL:
                     *v1 = 1;
@@ -168,31 +656,61 @@ static int matrix_mt__index(lua_State * L) {
                     point++;
                     break;
                 case LUA_TTABLE:
-                    lua_pushinteger(L, 1);
-                    lua_gettable(L, -2);
+                    lua_rawgeti(L, -1, 1);
                     *v1 = luaL_checkinteger(L, -1);
-                    lua_pushinteger(L, 2);
-                    lua_gettable(L, -3); // stack: table, row1, 2
+                    lua_rawgeti(L, -2, 2);
                     *vn = luaL_checkinteger(L, -1);
                     break;
                 default:
                     return luaL_error(L, "invalid stride index type");
             }
+            lua_settop(L, top);
         }
-        if (row1 < 1 || col1 < 1 || row1 > rown || col1 > coln || rown > m->rows || coln > m->cols) {
-            return luaL_error(L, "invalid stride index {%d..%d, %d..%d}", row1, rown, col1, coln);
+    }
+    if (*row1 < 1 || *col1 < 1 || *row1 > *rown || *col1 > *coln || *rown > rows || *coln > cols) {
+        return luaL_error(L, "invalid stride index {" MATRIX_SIZE_FMT ".." MATRIX_SIZE_FMT ", " MATRIX_SIZE_FMT ".." MATRIX_SIZE_FMT "}", matrix_size_arg(*row1), matrix_size_arg(*rown), matrix_size_arg(*col1), matrix_size_arg(*coln));
+    }
+    return point;
+}
+
+static int matrix_mt__index(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    if (lua_type(L, 2) == LUA_TSTRING && lua_getmetatable(L, 1)) {
+        const char * key = lua_tostring(L, 2);
+        if (!strcmp(key, "cols")) {
+            lua_pushinteger(L, m->cols);
+            return 1;
+        } else if (!strcmp(key, "rows")) {
+            lua_pushinteger(L, m->rows);
+            return 1;
+        } else if (!strcmp(key, "readonly")) {
+            lua_pushboolean(L, matrix_isreadonly(m));
+            return 1;
         }
+        lua_pushvalue(L, 2); // stack: {m, key, ..., mt} -> {m, key, ..., mt, key}
+        lua_rawget(L, -2); // stack -> {m, key, ..., rawget(mt, key)}
+        if (!lua_isnil(L, -1)) return 1;
+        return luaL_error(L, "method %s not available in metatable", key);
+    }
+    if (lua_isnumber(L, 2)) {
+        matrix_size_t idx = luaL_checkinteger(L, 2);
+        if (idx < 1 || idx > m->rows * m->cols) return luaL_error(L, "index out of bounds: " MATRIX_SIZE_FMT, matrix_size_arg(idx));
+        lua_pushnumber(L, m->d[idx-1]);
+    } else if (lua_istable(L, 2) || lua_isuserdata(L, 2)) {
+        matrix_size_t row1, rown, col1, coln;
+        int point = matrix_checkslice(L, 2, m->rows, m->cols, &row1, &rown, &col1, &coln);
         if (point == 2) {
             lua_pushnumber(L, m->d[(col1-1) * m->rows + row1-1]);
+        } else if (row1 == 1 && rown == m->rows) { // whole columns, contiguous
+            push_matrix_cow(L, 1, m->rows, coln - col1 + 1, (col1 - 1) * m->rows);
         } else {
-            int stride = m->rows;
-            int limit = coln * stride;
-            int height = rown - row1 + 1;
+            matrix_size_t stride = m->rows;
+            matrix_size_t limit = coln * stride;
+            matrix_size_t height = rown - row1 + 1;
             struct Matrix * dest = push_matrix(L, height, coln - col1 + 1);
-            int i, j, k = 0;
-            for (j = (col1 - 1)*stride + row1 - 1; j < limit; j += stride) {
-                for (i = j; i < j + height; i++) dest->d[k++] = m->d[i];
-            }
+            matrix_size_t j, k = 0;
+            for (j = (col1 - 1)*stride + row1 - 1; j < limit; j += stride, k += height)
+                memcpy(dest->d + k, m->d + j, sizeof (MATRIX_TYPE[height]));
         }
     } else return luaL_error(L, "invalid index type");
     return 1;
@@ -203,45 +721,18 @@ static int matrix_mt__index(lua_State * L) {
  * m[slice] = matrix or value -- if src is matrix, then its sice must be slice conformant
  */
 static int matrix_mt__newindex(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * m = matrix_checkwritable(L, 1);
     if (lua_isnumber(L, 2)) {
-        int idx = luaL_checkinteger(L, 2);
-        if (idx < 1 || idx > m->rows * m->cols) return luaL_error(L, "index out of bounds: %d", idx);
+        matrix_size_t idx = luaL_checkinteger(L, 2);
+        if (idx < 1 || idx > m->rows * m->cols) return luaL_error(L, "index out of bounds: " MATRIX_SIZE_FMT, matrix_size_arg(idx));
         m->d[idx-1] = luaL_checknumber(L, 3);
-    } else if (lua_istable(L, 2)) { // stride support {rows, cols}, where they can be nil, a number or {from, to}
-        int dim, row1, rown, col1, coln;
-        for (dim = 1; dim <= 2; dim++) {
-            int * v1, * vn, n;
-            if (dim == 1) { v1=&row1; vn=&rown; n=m->rows; } else { v1=&col1; vn=&coln; n=m->cols; }
-            lua_pushinteger(L, dim);
-            lua_gettable(L, 2);
-            switch (lua_type(L, -1)) {
-                case LUA_TNIL:
-                    *v1 = 1;
-                    *vn = n;
-                    break;
-                case LUA_TNUMBER:
-                    *v1 = *vn = luaL_checkinteger(L, -1);
-                    break;
-                case LUA_TTABLE:
-                    lua_pushinteger(L, 1);
-                    lua_gettable(L, -2);
-                    *v1 = luaL_checkinteger(L, -1);
-                    lua_pushinteger(L, 2);
-                    lua_gettable(L, -3); // stack: table, row1, 2
-                    *vn = luaL_checkinteger(L, -1);
-                    break;
-                default:
-                    return luaL_error(L, "invalid stride index type");
-            }
-        }
-        if (row1 < 1 || col1 < 1 || row1 > rown || col1 > coln || rown > m->rows || coln > m->cols) {
-            return luaL_error(L, "invalid stride index {%d..%d, %d..%d}", row1, rown, col1, coln);
-        }
-        int stride = m->rows;
-        int limit = coln * stride;
-        int height = rown - row1 + 1;
-        int i, j, k = 0;
+    } else if (lua_istable(L, 2) || lua_isuserdata(L, 2)) {
+        matrix_size_t row1, rown, col1, coln;
+        matrix_checkslice(L, 2, m->rows, m->cols, &row1, &rown, &col1, &coln);
+        matrix_size_t stride = m->rows;
+        matrix_size_t limit = coln * stride;
+        matrix_size_t height = rown - row1 + 1;
+        matrix_size_t i, j, k = 0;
         if (lua_isnumber(L, 3)) {
             MATRIX_TYPE src = lua_tonumber(L, 3);
             for (j = row1 - 1 + (col1 - 1)*stride; j < limit; j += stride) {
@@ -250,20 +741,78 @@ static int matrix_mt__newindex(lua_State * L) {
         } else {
             struct Matrix * src = (struct Matrix*)luaL_checkudata(L, 3, MATRIX_MT);
             if (src->rows != height || src->cols != coln - col1 + 1)
-                return luaL_error(L, "non-conforming source %d*%d matrix, expecting %d*%d",
-                        src->rows, src->cols, height, coln - col1  + 1);
-            for (j = (col1 - 1)*stride + row1 - 1; j < limit; j += stride) {
-                for (i = j; i < j + height; i++) m->d[i] = src->d[k++];
-            }
+                return luaL_error(L, "non-conforming source " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix, expecting " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT,
+                        matrix_size_arg(src->rows), matrix_size_arg(src->cols), matrix_size_arg(height), matrix_size_arg(coln - col1  + 1));
+            for (j = (col1 - 1)*stride + row1 - 1; j < limit; j += stride, k += height)
+                memmove(m->d + j, src->d + k, sizeof (MATRIX_TYPE[height]));
         }
     } else return luaL_error(L, "invalid index type");
     return 1;
 }
 
+#ifdef MATRIX_ENABLE_WINDOW
+/**
+ * for win, i, j in m:window(h, w, stride) do ... end
+ *
+ * Moves an h*w window over m, down the rows first and then along the columns, stride being a
+ * number or a {rows, cols} pair (default 1). win is the same matrix at every step, overwritten
+ * with the content under the window whose top left corner is at row i, column j; copy it
+ * (win[{}]) to keep it.
+ */
+struct MatrixWindow {
+    matrix_size_t h, w, sr, sc;
+    matrix_size_t i, j; // next top left corner, 0 based
+};
+
+static int matrix_window_next(lua_State * L) {
+    struct Matrix * m = (struct Matrix *)lua_touserdata(L, lua_upvalueindex(1));
+    struct MatrixWindow * win = (struct MatrixWindow *)lua_touserdata(L, lua_upvalueindex(3));
+    matrix_size_t k;
+    if (win->i + win->h > m->rows) {
+        win->i = 0;
+        win->j += win->sc;
+    }
+    if (win->j + win->w > m->cols || win->h > m->rows) return 0;
+    lua_pushvalue(L, lua_upvalueindex(2));
+    struct Matrix * out = matrix_checkwritable(L, -1);
+    for (k = 0; k < win->w; k++)
+        memcpy(out->d + k * win->h, m->d + (win->j + k) * m->rows + win->i, sizeof (MATRIX_TYPE[win->h]));
+    lua_pushinteger(L, win->i + 1);
+    lua_pushinteger(L, win->j + 1);
+    win->i += win->sr;
+    return 3;
+}
+
+static int matrix_mt_window(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    matrix_size_t h = luaL_checkinteger(L, 2), w = luaL_checkinteger(L, 3), sr, sc;
+    if (lua_istable(L, 4)) {
+        lua_rawgeti(L, 4, 1);
+        sr = luaL_checkinteger(L, -1);
+        lua_rawgeti(L, 4, 2);
+        sc = luaL_checkinteger(L, -1);
+    } else {
+        sr = sc = luaL_optinteger(L, 4, 1);
+    }
+    if (h < 1 || w < 1 || h > m->rows || w > m->cols || sr < 1 || sc < 1)
+        return luaL_error(L, "invalid " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " window with stride " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " over a " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix", matrix_size_arg(h), matrix_size_arg(w), matrix_size_arg(sr), matrix_size_arg(sc), matrix_size_arg(m->rows), matrix_size_arg(m->cols));
+    lua_settop(L, 1);
+    push_matrix(L, h, w);
+    struct MatrixWindow * win = (struct MatrixWindow *) lua_newuserdata(L, sizeof (struct MatrixWindow));
+    win->h = h;
+    win->w = w;
+    win->sr = sr;
+    win->sc = sc;
+    win->i = win->j = 0;
+    lua_pushcclosure(L, &matrix_window_next, 3);
+    return 1;
+}
+#endif
+
 #ifdef MATRIX_ENABLE__TOSTRING
 static int matrix_mt__tostring(lua_State * L) {
     struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    int i, limit = m->rows * m->cols;
+    matrix_size_t i, limit = m->rows * m->cols;
     lua_checkstack(L, 3 + 2 * MATRIX_MAX_TOSTRING);
     lua_pushstring(L, "[ ");
     if (limit > MATRIX_MAX_TOSTRING) limit = MATRIX_MAX_TOSTRING + 1;
@@ -286,9 +835,9 @@ static int matrix_mt__tostring(lua_State * L) {
 
 #ifdef MATRIX_ENABLE_TOTABLE
 static int matrix_mt_totable(lua_State * L) {
-    int i = 0;
+    matrix_size_t i = 0;
     struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    int size = m->rows * m->cols;
+    matrix_size_t size = m->rows * m->cols;
     lua_createtable(L, size, 2);
     while (i < size) {
         MATRIX_TYPE v = m->d[i];
@@ -304,94 +853,289 @@ static int matrix_mt_totable(lua_State * L) {
 }
 #endif
 
-#define matrix_mt__declare_binop(name, op) \
-    static int matrix_mt##name(lua_State * L) { \
-        if (lua_isnumber(L, 1)) { \
-            struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT); \
-            MATRIX_TYPE param = lua_tonumber(L, 1); \
-            struct Matrix * dest = push_matrix(L, m->rows, m->cols); \
-            int i, size = m->rows * m->cols; \
-            for (i = 0; i < size; i++) dest->d[i] = op(param, m->d[i]); \
-            return 1; \
-        } \
-        struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT); \
-        switch (lua_type(L, 2)) { \
-            case LUA_TNUMBER: { \
-                MATRIX_TYPE param = lua_tonumber(L, 2); \
-                struct Matrix * dest = push_matrix(L, m->rows, m->cols); \
-                int i, size = m->rows * m->cols; \
-                for (i = 0; i < size; i++) dest->d[i] = op(m->d[i], param); \
-                return 1; \
-            } \
-            case LUA_TUSERDATA: { \
-                struct Matrix * param = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT); \
-                if (m->rows == param->rows) { \
-                    if (m->cols == param->cols) { \
-                        struct Matrix * dest = push_matrix(L, m->rows, m->cols); \
-                        int i, size = m->rows * m->cols; \
-                        for (i = 0; i < size; i++) dest->d[i] = op(m->d[i], param->d[i]); \
-                        return 1; \
-                    } else if (param->cols == 1) { /* param is a vertical vector */ \
-                        struct Matrix * dest = push_matrix(L, m->rows, m->cols); \
-                        int i, j, size = m->rows * m->cols; \
-                        for (j = 0; j < size; j += m->rows) \
-                            for (i = 0; i < m->rows; i++) \
-                                dest->d[j + i] = op(m->d[j + i], param->d[i]); \
-                        return 1; \
-                    } else if (param->cols == 1) { /* m is the vertical vector */ \
-                        struct Matrix * dest = push_matrix(L, m->rows, param->cols); \
-                        int i, j, size = m->rows * param->cols; \
-                        for (j = 0; j < size; j += m->rows) \
-                            for (i = 0; i < m->rows; i++) \
-                                dest->d[j + i] = op(m->d[i], param->d[j + i]); \
-                        return 1; \
-                    } \
-                } else if (m->cols == param->cols) { \
-                    if (param->rows == 1) { /* param is the row vector */ \
-                        struct Matrix * dest = push_matrix(L, m->rows, m->cols); \
-                        int i = 0, i2, j; \
-                        for (j = 0; j < m->cols; j += m->cols) { \
-                            MATRIX_TYPE p = param->d[j]; \
-                            for (i2 = m->rows; i2 >= 0; i2--, i++) \
-                                dest->d[i] = op(m->d[i], p); \
-                        } \
-                        return 1; \
-                    } else if (m->rows == 1) { /* m is the row vector*/ \
-                        struct Matrix * dest = push_matrix(L, param->rows, m->cols); \
-                        int i = 0, i2, j; \
-                        for (j = 0; j < m->cols; j += m->cols) { \
-                            MATRIX_TYPE v = m->d[j]; \
-                            for (i2 = param->rows; i2 >= 0; i2--, i++) \
-                                dest->d[i] = op(v, param->d[i]); \
-                        } \
-                        return 1; \
-                    } \
-                } \
-                return luaL_error(L, "non conformat matrices %d*%d, %d*%d", m->rows, m->cols, param->rows, param->cols); \
-            } \
-        } \
-        return luaL_error(L, "invalid parameters for operand \"" # name "\""); \
-    }
-
-#ifdef MATRIX_ENABLE__ADD
-#define op(x,y) (x)+(y)
-matrix_mt__declare_binop(__add, op)
-#undef op
+#if defined(MATRIX_TYPE_FLOAT)
+#  define MATRIX_ABS_OP(x) fabsf(x)
+#  define MATRIX_FLOOR_OP(x) floorf(x)
+#  define MATRIX_CEIL_OP(x) ceilf(x)
+#elif defined(MATRIX_TYPE_DOUBLE)
+#  define MATRIX_ABS_OP(x) fabs(x)
+#  define MATRIX_FLOOR_OP(x) floor(x)
+#  define MATRIX_CEIL_OP(x) ceil(x)
+#else
+#  define MATRIX_ABS_OP(x) ((x)<0 ? -(x) : (x))
+#  define MATRIX_FLOOR_OP(x) (x)
+#  define MATRIX_CEIL_OP(x) (x)
 #endif
-#ifdef MATRIX_ENABLE__SUB
-#define op(x,y) (x)-(y)
-matrix_mt__declare_binop(__sub, op)
-#undef op
+
+#if defined(MATRIX_TYPE_FLOAT)
+#  define MATRIX_EPSILON FLT_EPSILON
+#else
+#  define MATRIX_EPSILON DBL_EPSILON
+#endif
+
+#define MATRIX_ADD_OP(x,y) (x)+(y)
+#define MATRIX_SUB_OP(x,y) (x)-(y)
+#define MATRIX_MUL_OP(x,y) (x)*(y)
+#define MATRIX_DIV_OP(x,y) (x)/(y)
+#define MATRIX_UNM_OP(x) (-(x))
+#define MATRIX_LT_OP(x,y) ((x) < (y))
+#define MATRIX_LE_OP(x,y) ((x) <= (y))
+#define MATRIX_GT_OP(x,y) ((x) > (y))
+#define MATRIX_GE_OP(x,y) ((x) >= (y))
+#define MATRIX_EQ_OP(x,y) ((x) == (y))
+
+/**
+ * Element to element kernels: c = a op b (vv), c = a op s (vs) and c = s op b (sv) for vectors of
+ * n elements, and c = op(a) for maps.
+ */
+#define matrix_declare_binop_kernels(attr, vv, vs, sv, op) \
+    attr static void vv(matrix_size_t n, const MATRIX_TYPE * a, const MATRIX_TYPE * b, MATRIX_TYPE * c) { \
+        matrix_size_t i; \
+        for (i = 0; i < n; i++) c[i] = op(a[i], b[i]); \
+    } \
+    attr static void vs(matrix_size_t n, const MATRIX_TYPE * a, MATRIX_TYPE s, MATRIX_TYPE * c) { \
+        matrix_size_t i; \
+        for (i = 0; i < n; i++) c[i] = op(a[i], s); \
+    } \
+    attr static void sv(matrix_size_t n, MATRIX_TYPE s, const MATRIX_TYPE * b, MATRIX_TYPE * c) { \
+        matrix_size_t i; \
+        for (i = 0; i < n; i++) c[i] = op(s, b[i]); \
+    }
+
+#define matrix_declare_map_kernel(attr, name, op) \
+    attr static void name(matrix_size_t n, const MATRIX_TYPE * a, MATRIX_TYPE * c) { \
+        matrix_size_t i; \
+        for (i = 0; i < n; i++) c[i] = op(a[i]); \
+    }
+
+// comparisons, writing a byte per element (1 where true)
+#define matrix_declare_cmp_kernels(attr, vv, vs, op) \
+    attr static void vv(matrix_size_t n, const MATRIX_TYPE * a, const MATRIX_TYPE * b, unsigned char * c) { \
+        matrix_size_t i; \
+        for (i = 0; i < n; i++) c[i] = op(a[i], b[i]); \
+    } \
+    attr static void vs(matrix_size_t n, const MATRIX_TYPE * a, MATRIX_TYPE s, unsigned char * c) { \
+        matrix_size_t i; \
+        for (i = 0; i < n; i++) c[i] = op(a[i], s); \
+    }
+
+enum { MATRIX_ADD, MATRIX_SUB, MATRIX_MUL, MATRIX_DIV, MATRIX_BINOPS };
+enum { MATRIX_UNM, MATRIX_ABS, MATRIX_FLOOR, MATRIX_CEIL, MATRIX_MAPS };
+enum { MATRIX_LT, MATRIX_LE, MATRIX_GT, MATRIX_GE, MATRIX_EQ, MATRIX_CMPS };
+
+/**
+ * The kernels are compiled for every instruction set the target architecture may have (see
+ * matrix_kernels.h), and luaopen_matrix picks the best one supported by the running CPU, so a
+ * single binary can be deployed anywhere without -march=native.
+ */
+struct MatrixKernels {
+    const char * name;
+    void (*gemm)(matrix_size_t m, matrix_size_t n, matrix_size_t k, MATRIX_TYPE alpha, const MATRIX_TYPE * a, matrix_size_t lda,
+            const MATRIX_TYPE * b, matrix_size_t ldb, MATRIX_TYPE beta, MATRIX_TYPE * c, matrix_size_t ldc);
+    void (*gemm_tn)(matrix_size_t m, matrix_size_t n, matrix_size_t k, MATRIX_TYPE alpha, const MATRIX_TYPE * a, matrix_size_t lda,
+            const MATRIX_TYPE * b, matrix_size_t ldb, MATRIX_TYPE beta, MATRIX_TYPE * c, matrix_size_t ldc);
+    void (*transpose)(matrix_size_t rows, matrix_size_t cols, const MATRIX_TYPE * src, matrix_size_t lds, MATRIX_TYPE * dest);
+    MATRIX_TYPE (*sum)(matrix_size_t n, const MATRIX_TYPE * a);
+    void (*vv[MATRIX_BINOPS])(matrix_size_t n, const MATRIX_TYPE * a, const MATRIX_TYPE * b, MATRIX_TYPE * c);
+    void (*vs[MATRIX_BINOPS])(matrix_size_t n, const MATRIX_TYPE * a, MATRIX_TYPE s, MATRIX_TYPE * c);
+    void (*sv[MATRIX_BINOPS])(matrix_size_t n, MATRIX_TYPE s, const MATRIX_TYPE * b, MATRIX_TYPE * c);
+    void (*map[MATRIX_MAPS])(matrix_size_t n, const MATRIX_TYPE * a, MATRIX_TYPE * c);
+    void (*cmp_vv[MATRIX_CMPS])(matrix_size_t n, const MATRIX_TYPE * a, const MATRIX_TYPE * b, unsigned char * c);
+    void (*cmp_vs[MATRIX_CMPS])(matrix_size_t n, const MATRIX_TYPE * a, MATRIX_TYPE s, unsigned char * c);
+    void (*select)(matrix_size_t n, const unsigned char * mask, const MATRIX_TYPE * a, const MATRIX_TYPE * b, MATRIX_TYPE * c);
+    void (*gather)(matrix_size_t n, const matrix_size_t * idx, const MATRIX_TYPE * src, MATRIX_TYPE * dest);
+    void (*axpy)(matrix_size_t n, MATRIX_TYPE alpha, const MATRIX_TYPE * x, matrix_size_t incx, MATRIX_TYPE * y);
+    int64_t (*dot_i8)(matrix_size_t n, const int8_t * a, const int8_t * b);
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define MATRIX_ISA_X86
+#  include <immintrin.h> // intrinsics of every target are declared, but used only by the matching tier
+#endif
+
+// baseline, whatever the compiler flags allow:
+#if defined(__x86_64__)
+#  define MATRIX_ISA sse2
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define MATRIX_ISA neon
+#  define MATRIX_KERNEL_I8 MATRIX_KERNEL_I8_NEON
+#else
+#  define MATRIX_ISA portable
+#endif
+#define MATRIX_KERNEL_ATTR
+#include "matrix_kernels.h"
+
+#ifdef MATRIX_ISA_X86
+#  ifndef __x86_64__
+#    define MATRIX_ISA sse2
+#    define MATRIX_KERNEL_ATTR __attribute__((target("sse2")))
+#    include "matrix_kernels.h"
+#  endif
+#  define MATRIX_ISA avx2
+#  define MATRIX_KERNEL_ATTR __attribute__((target("avx2,fma")))
+#  define MATRIX_KERNEL_I8 MATRIX_KERNEL_I8_AVX2
+#  include "matrix_kernels.h"
+#  define MATRIX_ISA avx512
+#  define MATRIX_KERNEL_ATTR __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,fma")))
+#  define MATRIX_KERNEL_I8 MATRIX_KERNEL_I8_AVX512
+#  include "matrix_kernels.h"
+#  define MATRIX_ISA avx512vnni
+#  define MATRIX_KERNEL_ATTR __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx512vnni,fma")))
+#  define MATRIX_KERNEL_I8 MATRIX_KERNEL_I8_VNNI
+#  include "matrix_kernels.h"
+#endif
+
+// from worst to best
+static const struct MatrixKernels * const matrix_kernel_tiers[] = {
+#if defined(__x86_64__)
+    &matrix_kernels_sse2,
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+    &matrix_kernels_neon,
+#else
+    &matrix_kernels_portable,
+#endif
+#ifdef MATRIX_ISA_X86
+#  ifndef __x86_64__
+    &matrix_kernels_sse2,
+#  endif
+    &matrix_kernels_avx2,
+    &matrix_kernels_avx512,
+    &matrix_kernels_avx512vnni,
+#endif
+    NULL
+};
+
+/**
+ * kernels in use, process wide (see matrix.cpu). Any thread may switch them while others are
+ * computing, so the pointer is read atomically, once per operation (functions calling kernels in
+ * loops keep it in a local variable), and every tier computes the same results.
+ */
+#ifdef MATRIX_ATOMICS
+static _Atomic(const struct MatrixKernels *) matrix_kernels_current;
+#  define matrix_kernels atomic_load_explicit(&matrix_kernels_current, memory_order_relaxed)
+#  define matrix_kernels_set(k) atomic_store_explicit(&matrix_kernels_current, (k), memory_order_relaxed)
+#else // no threads without C11 atomics (ASYNC and SHARE need them as well)
+static const struct MatrixKernels * matrix_kernels_current;
+#  define matrix_kernels matrix_kernels_current
+#  define matrix_kernels_set(k) (matrix_kernels_current = (k))
+#endif
+
+static int matrix_cpu_supports(const struct MatrixKernels * k) {
+#ifdef MATRIX_ISA_X86
+    __builtin_cpu_init();
+    if (!strcmp(k->name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+    if (!strcmp(k->name, "avx2"))
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (!strcmp(k->name, "avx512"))
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+            __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") &&
+            __builtin_cpu_supports("fma");
+    if (!strcmp(k->name, "avx512vnni"))
+        return __builtin_cpu_supports("avx512vnni") && matrix_cpu_supports(&matrix_kernels_avx512);
+#endif
+    return 1;
+}
+
+/**
+ * matrix.cpu() returns the name of the kernels in use ("sse2", "avx2", "avx512", "avx512vnni",
+ * "neon" or "portable"), matrix.cpu(name) switches to other ones (for benchmarks and tests).
+ */
+static int matrix_cpu(lua_State * L) {
+    if (!lua_isnoneornil(L, 1)) {
+        const char * name = luaL_checkstring(L, 1);
+        int i;
+        for (i = 0; matrix_kernel_tiers[i] && strcmp(matrix_kernel_tiers[i]->name, name); i++);
+        if (!matrix_kernel_tiers[i] || !matrix_cpu_supports(matrix_kernel_tiers[i]))
+            return luaL_error(L, "kernels for %s not available", name);
+        matrix_kernels_set(matrix_kernel_tiers[i]);
+    }
+    lua_pushstring(L, matrix_kernels->name);
+    return 1;
+}
+
+#define matrix_op_gemm matrix_kernels->gemm
+#define matrix_op_gemm_tn matrix_kernels->gemm_tn
+
+/**
+ * element to element operation between numbers, matrices, row vectors and column vectors, the
+ * vectors being repeated along the other dimension
+ */
+static int matrix_op_binop(lua_State * L, const char * name,
+        void (*vv)(matrix_size_t, const MATRIX_TYPE *, const MATRIX_TYPE *, MATRIX_TYPE *),
+        void (*vs)(matrix_size_t, const MATRIX_TYPE *, MATRIX_TYPE, MATRIX_TYPE *),
+        void (*sv)(matrix_size_t, MATRIX_TYPE, const MATRIX_TYPE *, MATRIX_TYPE *)) {
+    if (lua_isnumber(L, 1)) {
+        struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+        MATRIX_TYPE param = lua_tonumber(L, 1);
+        struct Matrix * dest = push_matrix(L, m->rows, m->cols);
+        sv(m->rows * m->cols, param, m->d, dest->d);
+        return 1;
+    }
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    switch (lua_type(L, 2)) {
+        case LUA_TNUMBER: {
+            MATRIX_TYPE param = lua_tonumber(L, 2);
+            struct Matrix * dest = push_matrix(L, m->rows, m->cols);
+            vs(m->rows * m->cols, m->d, param, dest->d);
+            return 1;
+        }
+        case LUA_TUSERDATA: {
+            struct Matrix * param = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+            struct Matrix * dest;
+            matrix_size_t j;
+            if (m->rows == param->rows && m->cols == param->cols) {
+                dest = push_matrix(L, m->rows, m->cols);
+                vv(m->rows * m->cols, m->d, param->d, dest->d);
+            } else if (m->rows == param->rows && param->cols == 1) { // param is a vertical vector
+                dest = push_matrix(L, m->rows, m->cols);
+                for (j = 0; j < m->cols; j++)
+                    vv(m->rows, m->d + j * m->rows, param->d, dest->d + j * m->rows);
+            } else if (m->rows == param->rows && m->cols == 1) { // m is the vertical vector
+                dest = push_matrix(L, m->rows, param->cols);
+                for (j = 0; j < param->cols; j++)
+                    vv(m->rows, m->d, param->d + j * m->rows, dest->d + j * m->rows);
+            } else if (m->cols == param->cols && param->rows == 1) { // param is the row vector
+                dest = push_matrix(L, m->rows, m->cols);
+                for (j = 0; j < m->cols; j++)
+                    vs(m->rows, m->d + j * m->rows, param->d[j], dest->d + j * m->rows);
+            } else if (m->cols == param->cols && m->rows == 1) { // m is the row vector
+                dest = push_matrix(L, param->rows, m->cols);
+                for (j = 0; j < m->cols; j++)
+                    sv(param->rows, m->d[j], param->d + j * param->rows, dest->d + j * param->rows);
+            } else {
+                return luaL_error(L, "non conformat matrices " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT ", " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(m->rows), matrix_size_arg(m->cols), matrix_size_arg(param->rows), matrix_size_arg(param->cols));
+            }
+            return 1;
+        }
+    }
+    return luaL_error(L, "invalid parameters for operand \"%s\"", name);
+}
+
+#define matrix_mt__declare_binop(name, vv, vs, sv) \
+    static int matrix_mt##name(lua_State * L) { \
+        return matrix_op_binop(L, #name, vv, vs, sv); \
+    }
+
+// the three kernels come from the same tier, even if matrix.cpu switches them meanwhile
+#define matrix_mt__declare_kernel_binop(name, op) \
+    static int matrix_mt##name(lua_State * L) { \
+        const struct MatrixKernels * kernels = matrix_kernels; \
+        return matrix_op_binop(L, #name, kernels->vv[op], kernels->vs[op], kernels->sv[op]); \
+    }
+
+#ifdef MATRIX_ENABLE__ADD
+matrix_mt__declare_kernel_binop(__add, MATRIX_ADD)
+#endif
+#ifdef MATRIX_ENABLE__SUB
+matrix_mt__declare_kernel_binop(__sub, MATRIX_SUB)
 #endif
 #ifdef MATRIX_ENABLE__MUL
-#define op(x,y) (x)*(y)
-matrix_mt__declare_binop(__mul, op)
-#undef op
+matrix_mt__declare_kernel_binop(__mul, MATRIX_MUL)
 #endif
 #ifdef MATRIX_ENABLE__DIV
-#define op(x,y) (x)/(y)
-matrix_mt__declare_binop(__div, op)
-#undef op
+matrix_mt__declare_kernel_binop(__div, MATRIX_DIV)
 #endif
 #ifdef MATRIX_ENABLE__MOD
 #  if defined(MATRIX_TYPE_FLOAT)
@@ -401,7 +1145,8 @@ matrix_mt__declare_binop(__div, op)
 #  else
 #    error "MATRIX_ENABLE__MOD is only supported for float and double"
 #  endif
-matrix_mt__declare_binop(__mod, op)
+matrix_declare_binop_kernels(, matrix_mod_vv, matrix_mod_vs, matrix_mod_sv, op)
+matrix_mt__declare_binop(__mod, matrix_mod_vv, matrix_mod_vs, matrix_mod_sv)
 #undef op
 #endif
 #ifdef MATRIX_ENABLE__POW
@@ -412,7 +1157,8 @@ matrix_mt__declare_binop(__mod, op)
 #  else
 #    error "MATRIX_ENABLE__POW is only supported for float and double"
 #  endif
-matrix_mt__declare_binop(__pow, op)
+matrix_declare_binop_kernels(, matrix_pow_vv, matrix_pow_vs, matrix_pow_sv, op)
+matrix_mt__declare_binop(__pow, matrix_pow_vv, matrix_pow_vs, matrix_pow_sv)
 #undef op
 #endif
 
@@ -420,305 +1166,2538 @@ matrix_mt__declare_binop(__pow, op)
 static int matrix_mt__unm(lua_State * L) {
     struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
     struct Matrix * dest = push_matrix(L, m->rows, m->cols);
-    int i;
-    for (i = 0; i < m->rows * m->cols; i++) {
-        dest->d[i] = -m->d[i];
-    }
+    matrix_kernels->map[MATRIX_UNM](m->rows * m->cols, m->d, dest->d);
     return 1;
 }
 #endif
 
-#if defined(MATRIX_ENABLE_FLOOR) || defined(MATRIX_ENABLE_CEIL) || defined(MATRIX_ENABLE_ACOS) || \
-    defined(MATRIX_ENABLE_ASIN) || defined(MATRIX_ENABLE_ATAN) || defined(MATRIX_ENABLE_COS) || \
-    defined(MATRIX_ENABLE_SIN) || defined(MATRIX_ENABLE_TAN) || defined(MATRIX_ENABLE_COSH) || \
-    defined(MATRIX_ENABLE_SINH) || defined(MATRIX_ENABLE_TANH) || defined(MATRIX_ENABLE_EXP) || \
-    defined(MATRIX_ENABLE_LOG) || defined(MATRIX_ENABLE_LOG10) || defined(MATRIX_ENABLE_SQRT) || \
-    defined(MATRIX_ENABLE_ABS) || defined(MATRIX_ENABLE_ISINF) || defined(MATRIX_ENABLE_FINITE) || \
+#if defined(MATRIX_ENABLE_ACOS) || defined(MATRIX_ENABLE_ASIN) || defined(MATRIX_ENABLE_ATAN) || \
+    defined(MATRIX_ENABLE_COS) || defined(MATRIX_ENABLE_SIN) || defined(MATRIX_ENABLE_TAN) || \
+    defined(MATRIX_ENABLE_COSH) || defined(MATRIX_ENABLE_SINH) || defined(MATRIX_ENABLE_TANH) || \
+    defined(MATRIX_ENABLE_EXP) || defined(MATRIX_ENABLE_LOG) || defined(MATRIX_ENABLE_LOG10) || \
+    defined(MATRIX_ENABLE_SQRT) || defined(MATRIX_ENABLE_ISINF) || defined(MATRIX_ENABLE_FINITE) || \
     defined(MATRIX_ENABLE_ISNAN)
 static int matrix_op_unary(lua_State * L) {
     struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
     struct Matrix * dest = push_matrix(L, m->rows, m->cols);
-    int i;
+    matrix_size_t i;
     MATRIX_TYPE (*fn)(MATRIX_TYPE) = lua_touserdata(L, lua_upvalueindex(1));
     for (i = 0; i < m->rows * m->cols; i++) {
         dest->d[i] = fn(m->d[i]);
     }
-    return 1;
+    return 1;
+}
+#endif
+
+#if defined(MATRIX_ENABLE_FLOOR) || defined(MATRIX_ENABLE_CEIL) || defined(MATRIX_ENABLE_ABS)
+// unary functions with a kernel, whose index is the upvalue
+static int matrix_op_map(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * dest = push_matrix(L, m->rows, m->cols);
+    int map = (int)(intptr_t)lua_touserdata(L, lua_upvalueindex(1));
+    matrix_kernels->map[map](m->rows * m->cols, m->d, dest->d);
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_SUM
+static int matrix_mt_sum(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    lua_pushnumber(L, matrix_kernels->sum(m->rows * m->cols, m->d));
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_MASK
+/**
+ * mask = m:lt(x), m:le(x), m:gt(x), m:ge(x), m:eq(x)
+ * r = matrix.where(mask, a, b)
+ * m:masked_fill_(mask, v), n = m:count(mask), v = m:compress(mask)
+ *
+ * Masks are bit packed boolean matrices (column major, one bit per element). Every operand can
+ * be a number, a row vector, a column vector or a full matrix, as with the binops, and the loops
+ * go through the byte oriented kernels a chunk at a time.
+ */
+#define MATRIX_MASK_MT CAT_MATRIX_STR(MATRIX_TYPE) " mask"
+#define MATRIX_MASK_CHUNK 1024
+
+struct MatrixMask {
+    matrix_size_t rows, cols;
+    uint64_t bits[];
+};
+
+static struct MatrixMask * push_mask(lua_State * L, matrix_size_t rows, matrix_size_t cols) {
+    size_t words = ((size_t)matrix_checksize(L, rows, cols) + 63) / 64;
+    struct MatrixMask * mask = (struct MatrixMask *) lua_newuserdata(L, sizeof (struct MatrixMask) + sizeof (uint64_t[words]));
+    mask->rows = rows;
+    mask->cols = cols;
+    memset(mask->bits, 0, sizeof (uint64_t[words]));
+    luaL_setmetatable(L, MATRIX_MASK_MT);
+    return mask;
+}
+
+// bytes[0..n) = bits [offset, offset + n) of mask
+static void matrix_mask_load(const struct MatrixMask * mask, matrix_size_t offset, matrix_size_t n, unsigned char * bytes) {
+    matrix_size_t i;
+    for (i = 0; i < n; i++, offset++) bytes[i] = (mask->bits[offset >> 6] >> (offset & 63)) & 1;
+}
+
+// bits [offset, offset + n) of mask = bytes[0..n), a word at a time
+static void matrix_mask_store(struct MatrixMask * mask, matrix_size_t offset, matrix_size_t n, const unsigned char * bytes) {
+    while (n > 0) {
+        matrix_size_t bit = offset & 63, len = 64 - bit < n ? 64 - bit : n, l;
+        uint64_t word = 0, range = (len == 64 ? ~(uint64_t)0 : (((uint64_t)1 << len) - 1)) << bit;
+        for (l = 0; l < len; l++) word |= (uint64_t)bytes[l] << (bit + l);
+        mask->bits[offset >> 6] = (mask->bits[offset >> 6] & ~range) | word;
+        offset += len;
+        bytes += len;
+        n -= len;
+    }
+}
+
+static matrix_size_t matrix_mask_popcount(const struct MatrixMask * mask) {
+    size_t i, words = ((size_t)mask->rows * mask->cols + 63) / 64;
+    matrix_size_t count = 0;
+    for (i = 0; i < words; i++) {
+        uint64_t w = mask->bits[i];
+        for (; w; count++) w &= w - 1;
+    }
+    return count;
+}
+
+// operand of a broadcasting operation: a number, a matrix or a mask
+struct MatrixOperand {
+    const MATRIX_TYPE * d;          // NULL for numbers and masks
+    const struct MatrixMask * mask; // NULL for numbers and matrices
+    matrix_size_t rows, cols;
+    MATRIX_TYPE value;
+};
+
+static void matrix_operand(lua_State * L, int idx, struct MatrixOperand * o) {
+    o->d = NULL;
+    o->mask = NULL;
+    o->rows = o->cols = 1;
+    o->value = 0;
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        o->value = lua_tonumber(L, idx);
+    } else if ((o->mask = (struct MatrixMask *)luaL_testudata(L, idx, MATRIX_MASK_MT))) {
+        o->rows = o->mask->rows;
+        o->cols = o->mask->cols;
+    } else {
+        struct Matrix * m = (struct Matrix *)luaL_checkudata(L, idx, MATRIX_MT);
+        o->d = m->d;
+        o->rows = m->rows;
+        o->cols = m->cols;
+    }
+}
+
+/**
+ * shape of the result of operating on n operands, each one having the same number of rows (or
+ * just one) and the same number of columns (or just one). The loops run over loop[1] columns of
+ * loop[0] rows: when all the operands are either numbers or full sized they are seen as a single
+ * column, so that the kernels get the whole matrices at once.
+ */
+static void matrix_broadcast(lua_State * L, struct MatrixOperand * o, int n, matrix_size_t shape[2], matrix_size_t loop[2]) {
+    int i, flat = 1;
+    shape[0] = shape[1] = 1;
+    for (i = 0; i < n; i++) {
+        if (o[i].rows > shape[0]) shape[0] = o[i].rows;
+        if (o[i].cols > shape[1]) shape[1] = o[i].cols;
+    }
+    for (i = 0; i < n; i++) {
+        if ((o[i].rows != 1 && o[i].rows != shape[0]) || (o[i].cols != 1 && o[i].cols != shape[1]))
+            luaL_error(L, "non conformat operands " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT ", expecting " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(o[i].rows), matrix_size_arg(o[i].cols), matrix_size_arg(shape[0]), matrix_size_arg(shape[1]));
+        if ((o[i].d || o[i].mask) && (o[i].rows != shape[0] || o[i].cols != shape[1])) flat = 0;
+    }
+    loop[0] = shape[0];
+    loop[1] = shape[1];
+    if (flat) {
+        loop[0] *= loop[1];
+        loop[1] = 1;
+        for (i = 0; i < n; i++) if (o[i].d || o[i].mask) {
+            o[i].rows = loop[0];
+            o[i].cols = 1;
+        }
+    }
+}
+
+// offset of the element at row i of column j of o, repeating vectors along the other dimension
+#define matrix_operand_offset(o, i, j) (((o)->cols == 1 ? 0 : (j) * (o)->rows) + ((o)->rows == 1 ? 0 : (i)))
+
+/**
+ * values of o for the n rows from i of column j: a pointer to them, or NULL if they are all the
+ * same (*value)
+ */
+static const MATRIX_TYPE * matrix_operand_values(const struct MatrixOperand * o, matrix_size_t i, matrix_size_t j, MATRIX_TYPE * value) {
+    if (!o->d) {
+        *value = o->value;
+        return NULL;
+    }
+    if (o->rows == 1) {
+        *value = o->d[matrix_operand_offset(o, i, j)];
+        return NULL;
+    }
+    return o->d + matrix_operand_offset(o, i, j);
+}
+
+// same as matrix_operand_values, always filling buffer when values are repeated
+static const MATRIX_TYPE * matrix_operand_fill(const struct MatrixOperand * o, matrix_size_t i, matrix_size_t j, matrix_size_t n, MATRIX_TYPE * buffer) {
+    MATRIX_TYPE value;
+    const MATRIX_TYPE * d = matrix_operand_values(o, i, j, &value);
+    if (d) return d;
+    for (i = 0; i < n; i++) buffer[i] = value;
+    return buffer;
+}
+
+// bytes[0..n) = elements i..i+n-1 of column j of the mask o
+static void matrix_operand_bytes(const struct MatrixOperand * o, matrix_size_t i, matrix_size_t j, matrix_size_t n, unsigned char * bytes) {
+    if (o->rows == 1) {
+        matrix_size_t bit = matrix_operand_offset(o, i, j);
+        memset(bytes, (o->mask->bits[bit >> 6] >> (bit & 63)) & 1, n);
+    } else {
+        matrix_mask_load(o->mask, matrix_operand_offset(o, i, j), n, bytes);
+    }
+}
+
+static void matrix_checkmaskoperand(lua_State * L, int idx, struct MatrixOperand * o) {
+    o->mask = (struct MatrixMask *)luaL_checkudata(L, idx, MATRIX_MASK_MT);
+    o->d = NULL;
+    o->rows = o->mask->rows;
+    o->cols = o->mask->cols;
+}
+
+// x (at 2) compared with m (at 1), the upvalue being the comparison
+static int matrix_op_cmp(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    static const int flipped[MATRIX_CMPS] = {MATRIX_GT, MATRIX_GE, MATRIX_LT, MATRIX_LE, MATRIX_EQ};
+    int cmp = (int)(intptr_t)lua_touserdata(L, lua_upvalueindex(1));
+    struct MatrixOperand o[2];
+    unsigned char bytes[MATRIX_MASK_CHUNK];
+    matrix_size_t shape[2], loop[2], i, j;
+    luaL_checkudata(L, 1, MATRIX_MT);
+    matrix_operand(L, 1, &o[0]);
+    matrix_operand(L, 2, &o[1]);
+    if (o[1].mask) return luaL_error(L, "masks can not be compared");
+    matrix_broadcast(L, o, 2, shape, loop);
+    matrix_size_t rows = loop[0], cols = loop[1];
+    struct MatrixMask * mask = push_mask(L, shape[0], shape[1]);
+    for (j = 0; j < cols; j++) {
+        for (i = 0; i < rows; i += MATRIX_MASK_CHUNK) {
+            matrix_size_t n = rows - i < MATRIX_MASK_CHUNK ? rows - i : MATRIX_MASK_CHUNK;
+            MATRIX_TYPE va, vb;
+            const MATRIX_TYPE * a = matrix_operand_values(&o[0], i, j, &va);
+            const MATRIX_TYPE * b = matrix_operand_values(&o[1], i, j, &vb);
+            if (a && b) kernels->cmp_vv[cmp](n, a, b, bytes);
+            else if (a) kernels->cmp_vs[cmp](n, a, vb, bytes);
+            else if (b) kernels->cmp_vs[flipped[cmp]](n, b, va, bytes);
+            else {
+                kernels->cmp_vs[cmp](1, &va, vb, bytes);
+                memset(bytes, bytes[0], n);
+            }
+            matrix_mask_store(mask, j * rows + i, n, bytes);
+        }
+    }
+    return 1;
+}
+
+// r = matrix.where(mask, a, b): a where mask is true, b elsewhere
+static int matrix_where(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    struct MatrixOperand o[3];
+    unsigned char bytes[MATRIX_MASK_CHUNK];
+    MATRIX_TYPE fa[MATRIX_MASK_CHUNK], fb[MATRIX_MASK_CHUNK];
+    matrix_size_t shape[2], loop[2], i, j;
+    matrix_checkmaskoperand(L, 1, &o[0]);
+    matrix_operand(L, 2, &o[1]);
+    matrix_operand(L, 3, &o[2]);
+    if (o[1].mask || o[2].mask) return luaL_error(L, "where expects numbers or matrices to select from");
+    matrix_broadcast(L, o, 3, shape, loop);
+    matrix_size_t rows = loop[0], cols = loop[1];
+    struct Matrix * dest = push_matrix(L, shape[0], shape[1]);
+    for (j = 0; j < cols; j++) {
+        for (i = 0; i < rows; i += MATRIX_MASK_CHUNK) {
+            matrix_size_t n = rows - i < MATRIX_MASK_CHUNK ? rows - i : MATRIX_MASK_CHUNK;
+            matrix_operand_bytes(&o[0], i, j, n, bytes);
+            kernels->select(n, bytes, matrix_operand_fill(&o[1], i, j, n, fa),
+                    matrix_operand_fill(&o[2], i, j, n, fb), dest->d + j * rows + i);
+        }
+    }
+    return 1;
+}
+
+// m:masked_fill_(mask, v) sets v (a number or a broadcast matrix) where mask is true, in place
+static int matrix_mt_masked_fill_(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    struct Matrix * m = matrix_checkwritable(L, 1);
+    struct MatrixOperand o[3];
+    unsigned char bytes[MATRIX_MASK_CHUNK];
+    MATRIX_TYPE fv[MATRIX_MASK_CHUNK];
+    matrix_size_t shape[2], loop[2], i, j;
+    matrix_operand(L, 1, &o[0]);
+    matrix_checkmaskoperand(L, 2, &o[1]);
+    matrix_operand(L, 3, &o[2]);
+    if (o[2].mask) return luaL_error(L, "masked_fill_ expects a number or a matrix");
+    matrix_broadcast(L, o, 3, shape, loop);
+    if (shape[0] != m->rows || shape[1] != m->cols)
+        return luaL_error(L, "non conformat operands for masked_fill_ of a " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix", matrix_size_arg(m->rows), matrix_size_arg(m->cols));
+    matrix_size_t rows = loop[0], cols = loop[1];
+    for (j = 0; j < cols; j++) {
+        for (i = 0; i < rows; i += MATRIX_MASK_CHUNK) {
+            matrix_size_t n = rows - i < MATRIX_MASK_CHUNK ? rows - i : MATRIX_MASK_CHUNK;
+            MATRIX_TYPE * d = m->d + j * rows + i;
+            matrix_operand_bytes(&o[1], i, j, n, bytes);
+            kernels->select(n, bytes, matrix_operand_fill(&o[2], i, j, n, fv), d, d);
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+// m:count(mask) number of m's elements where the (broadcast) mask is true, mask:count() its bits
+static int matrix_mt_count(lua_State * L) {
+    struct MatrixMask * mask = (struct MatrixMask *)luaL_testudata(L, 1, MATRIX_MASK_MT);
+    if (mask) {
+        lua_pushinteger(L, matrix_mask_popcount(mask));
+        return 1;
+    }
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    mask = (struct MatrixMask *)luaL_checkudata(L, 2, MATRIX_MASK_MT);
+    if ((mask->rows != 1 && mask->rows != m->rows) || (mask->cols != 1 && mask->cols != m->cols))
+        return luaL_error(L, "non conformat mask " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " for a " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix", matrix_size_arg(mask->rows), matrix_size_arg(mask->cols), matrix_size_arg(m->rows), matrix_size_arg(m->cols));
+    lua_pushinteger(L, matrix_mask_popcount(mask) * (m->rows / mask->rows) * (m->cols / mask->cols));
+    return 1;
+}
+
+/**
+ * v = m:compress(mask) with mask as big as m returns a column vector with the elements where
+ * mask is true (column major order), with a column vector mask it returns the rows where it is
+ * true and with a row vector the columns. nil is returned if nothing is selected.
+ */
+static int matrix_mt_compress(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct MatrixMask * mask = (struct MatrixMask *)luaL_checkudata(L, 2, MATRIX_MASK_MT);
+    matrix_size_t count = matrix_mask_popcount(mask), i, j, k = 0;
+    struct Matrix * dest;
+#define matrix_mask_bit(i) ((mask->bits[(i) >> 6] >> ((i) & 63)) & 1)
+    if (mask->rows == m->rows && mask->cols == m->cols) {
+        if (!count) return 0;
+        dest = push_matrix(L, count, 1);
+        for (i = 0; i < m->rows * m->cols; i++) if (matrix_mask_bit(i)) dest->d[k++] = m->d[i];
+    } else if (mask->rows == m->rows && mask->cols == 1) {
+        if (!count) return 0;
+        dest = push_matrix(L, count, m->cols);
+        for (j = 0; j < m->cols; j++)
+            for (i = 0; i < m->rows; i++) if (matrix_mask_bit(i)) dest->d[k++] = m->d[j * m->rows + i];
+    } else if (mask->cols == m->cols && mask->rows == 1) {
+        if (!count) return 0;
+        dest = push_matrix(L, m->rows, count);
+        for (j = 0; j < m->cols; j++) if (matrix_mask_bit(j))
+            memcpy(dest->d + m->rows * k++, m->d + j * m->rows, sizeof (MATRIX_TYPE[m->rows]));
+    } else {
+        return luaL_error(L, "non conformat mask " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " for a " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix", matrix_size_arg(mask->rows), matrix_size_arg(mask->cols), matrix_size_arg(m->rows), matrix_size_arg(m->cols));
+    }
+#undef matrix_mask_bit
+    return 1;
+}
+
+// mask & mask, mask | mask, mask ~ mask (same sizes), ~mask
+static int matrix_mask_binop(lua_State * L, int op) {
+    struct MatrixMask * a = (struct MatrixMask *)luaL_checkudata(L, 1, MATRIX_MASK_MT);
+    struct MatrixMask * b = op == '!' ? a : (struct MatrixMask *)luaL_checkudata(L, 2, MATRIX_MASK_MT);
+    size_t i, size = (size_t)a->rows * a->cols, words = (size + 63) / 64;
+    if (a->rows != b->rows || a->cols != b->cols)
+        return luaL_error(L, "non conformat masks " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT ", " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(a->rows), matrix_size_arg(a->cols), matrix_size_arg(b->rows), matrix_size_arg(b->cols));
+    struct MatrixMask * dest = push_mask(L, a->rows, a->cols);
+    switch (op) {
+        case '&': for (i = 0; i < words; i++) dest->bits[i] = a->bits[i] & b->bits[i]; break;
+        case '|': for (i = 0; i < words; i++) dest->bits[i] = a->bits[i] | b->bits[i]; break;
+        case '~': for (i = 0; i < words; i++) dest->bits[i] = a->bits[i] ^ b->bits[i]; break;
+        default:
+            for (i = 0; i < words; i++) dest->bits[i] = ~a->bits[i];
+            if (size % 64) dest->bits[words - 1] &= ((uint64_t)1 << (size % 64)) - 1; // keep padding clear
+    }
+    return 1;
+}
+static int matrix_mask__band(lua_State * L) { return matrix_mask_binop(L, '&'); }
+static int matrix_mask__bor(lua_State * L) { return matrix_mask_binop(L, '|'); }
+static int matrix_mask__bxor(lua_State * L) { return matrix_mask_binop(L, '~'); }
+static int matrix_mask__bnot(lua_State * L) { return matrix_mask_binop(L, '!'); }
+
+// mask[i] (booleans), mask.rows, mask.cols and methods
+static int matrix_mask__index(lua_State * L) {
+    struct MatrixMask * mask = (struct MatrixMask *)luaL_checkudata(L, 1, MATRIX_MASK_MT);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        matrix_size_t idx = luaL_checkinteger(L, 2);
+        if (idx < 1 || idx > mask->rows * mask->cols) return luaL_error(L, "index out of bounds: " MATRIX_SIZE_FMT, matrix_size_arg(idx));
+        idx--;
+        lua_pushboolean(L, (mask->bits[idx >> 6] >> (idx & 63)) & 1);
+        return 1;
+    }
+    const char * key = luaL_checkstring(L, 2);
+    if (!strcmp(key, "rows")) {
+        lua_pushinteger(L, mask->rows);
+    } else if (!strcmp(key, "cols")) {
+        lua_pushinteger(L, mask->cols);
+    } else {
+        luaL_getmetatable(L, MATRIX_MASK_MT);
+        lua_getfield(L, -1, key);
+    }
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_INDEX
+/**
+ * p = matrix.index{3, 1, 2}  or  matrix.index(n) (identity)
+ * m:take_rows(p), m:take_cols(p), m:scatter_rows_(p, src)
+ * p:apply(m), p:inverse()
+ *
+ * Index vectors keep their (1 based) values as 0 based ints. Any function taking an index also
+ * accepts a table of integers.
+ */
+#define MATRIX_INDEX_MT CAT_MATRIX_STR(MATRIX_TYPE) " index"
+// rows gathered at once for every column, so that the indices and the output stay in cache
+#define MATRIX_GATHER_BLOCK 256
+
+struct MatrixIndex {
+    matrix_size_t n;
+    matrix_size_t i[];
+};
+
+static struct MatrixIndex * push_index(lua_State * L, matrix_size_t n) {
+    matrix_checksize(L, n, 1);
+    struct MatrixIndex * p = (struct MatrixIndex *) lua_newuserdata(L, sizeof (struct MatrixIndex) + sizeof (matrix_size_t[n]));
+    p->n = n;
+    luaL_setmetatable(L, MATRIX_INDEX_MT);
+    return p;
+}
+
+static int matrix_index(lua_State * L) {
+    struct MatrixIndex * p;
+    matrix_size_t i, n;
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        n = luaL_checkinteger(L, 1);
+        if (n < 0) return luaL_error(L, "invalid index size " MATRIX_SIZE_FMT, matrix_size_arg(n));
+        p = push_index(L, n);
+        for (i = 0; i < n; i++) p->i[i] = i;
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (matrix_size_t)lua_rawlen(L, 1);
+    p = push_index(L, n);
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        int isnum;
+        matrix_size_t v = (matrix_size_t)lua_tointegerx(L, -1, &isnum);
+        if (!isnum || v < 1) return luaL_error(L, "invalid index value at position " MATRIX_SIZE_FMT, matrix_size_arg(i + 1));
+        p->i[i] = v - 1;
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+// index at idx (converting tables in place), checking that every value is below limit
+static struct MatrixIndex * matrix_checkindex(lua_State * L, int idx, matrix_size_t limit) {
+    matrix_size_t i;
+    idx = lua_absindex(L, idx);
+    if (lua_istable(L, idx)) {
+        lua_pushcfunction(L, &matrix_index);
+        lua_pushvalue(L, idx);
+        lua_call(L, 1, 1);
+        lua_replace(L, idx);
+    }
+    struct MatrixIndex * p = (struct MatrixIndex *)luaL_checkudata(L, idx, MATRIX_INDEX_MT);
+    for (i = 0; i < p->n; i++)
+        if (p->i[i] >= limit) luaL_error(L, "index " MATRIX_SIZE_FMT " out of bounds (" MATRIX_SIZE_FMT ")", matrix_size_arg(p->i[i] + 1), matrix_size_arg(limit));
+    return p;
+}
+
+// dest = rows p of m, by blocks of MATRIX_GATHER_BLOCK rows
+static void matrix_op_take_rows(const struct Matrix * m, const struct MatrixIndex * p, struct Matrix * dest) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    matrix_size_t k, j;
+    for (k = 0; k < p->n; k += MATRIX_GATHER_BLOCK) {
+        matrix_size_t len = p->n - k < MATRIX_GATHER_BLOCK ? p->n - k : MATRIX_GATHER_BLOCK;
+        for (j = 0; j < m->cols; j++)
+            kernels->gather(len, p->i + k, m->d + j * m->rows, dest->d + j * p->n + k);
+    }
+}
+
+static int matrix_mt_take_rows(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct MatrixIndex * p = matrix_checkindex(L, 2, m->rows);
+    if (!p->n) return luaL_error(L, "empty index");
+    matrix_op_take_rows(m, p, push_matrix(L, p->n, m->cols));
+    return 1;
+}
+
+static int matrix_mt_take_cols(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct MatrixIndex * p = matrix_checkindex(L, 2, m->cols);
+    matrix_size_t k;
+    if (!p->n) return luaL_error(L, "empty index");
+    struct Matrix * dest = push_matrix(L, m->rows, p->n);
+    for (k = 0; k < p->n; k++)
+        memcpy(dest->d + k * m->rows, m->d + p->i[k] * m->rows, sizeof (MATRIX_TYPE[m->rows]));
+    return 1;
+}
+
+// m:scatter_rows_(p, src) sets the row p[k] of m to the row k of src, in place
+static int matrix_mt_scatter_rows_(lua_State * L) {
+    struct Matrix * m = matrix_checkwritable(L, 1);
+    struct MatrixIndex * p = matrix_checkindex(L, 2, m->rows);
+    struct Matrix * src = (struct Matrix*)luaL_checkudata(L, 3, MATRIX_MT);
+    matrix_size_t k, j;
+    if (src->rows != p->n || src->cols != m->cols)
+        return luaL_error(L, "non-conforming source " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix, expecting " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(src->rows), matrix_size_arg(src->cols), matrix_size_arg(p->n), matrix_size_arg(m->cols));
+    for (k = 0; k < p->n; k += MATRIX_GATHER_BLOCK) {
+        matrix_size_t len = p->n - k < MATRIX_GATHER_BLOCK ? p->n - k : MATRIX_GATHER_BLOCK, l;
+        for (j = 0; j < m->cols; j++) {
+            MATRIX_TYPE * col = m->d + j * m->rows;
+            const MATRIX_TYPE * s = src->d + j * p->n + k;
+            for (l = 0; l < len; l++) col[p->i[k + l]] = s[l];
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+// p:apply(m) == P:dot(m), P being the permutation matrix with ones at {i, p[i]}
+static int matrix_index_apply(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    struct MatrixIndex * p = matrix_checkindex(L, 1, m->rows);
+    if (p->n != m->rows) return luaL_error(L, "index of " MATRIX_SIZE_FMT " elements applied to " MATRIX_SIZE_FMT " rows", matrix_size_arg(p->n), matrix_size_arg(m->rows));
+    matrix_op_take_rows(m, p, push_matrix(L, p->n, m->cols));
+    return 1;
+}
+
+static int matrix_index_inverse(lua_State * L) {
+    struct MatrixIndex * p = (struct MatrixIndex *)luaL_checkudata(L, 1, MATRIX_INDEX_MT);
+    struct MatrixIndex * inv = push_index(L, p->n);
+    matrix_size_t i;
+    for (i = 0; i < p->n; i++) inv->i[i] = -1;
+    for (i = 0; i < p->n; i++) {
+        if (p->i[i] >= p->n || inv->i[p->i[i]] >= 0) return luaL_error(L, "not a permutation");
+        inv->i[p->i[i]] = i;
+    }
+    return 1;
+}
+
+static int matrix_index_totable(lua_State * L) {
+    struct MatrixIndex * p = (struct MatrixIndex *)luaL_checkudata(L, 1, MATRIX_INDEX_MT);
+    matrix_size_t i;
+    lua_createtable(L, p->n, 0);
+    for (i = 0; i < p->n; i++) {
+        lua_pushinteger(L, p->i[i] + 1);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int matrix_index__len(lua_State * L) {
+    lua_pushinteger(L, ((struct MatrixIndex *)luaL_checkudata(L, 1, MATRIX_INDEX_MT))->n);
+    return 1;
+}
+
+// p[i] and methods
+static int matrix_index__index(lua_State * L) {
+    struct MatrixIndex * p = (struct MatrixIndex *)luaL_checkudata(L, 1, MATRIX_INDEX_MT);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        matrix_size_t idx = luaL_checkinteger(L, 2);
+        if (idx < 1 || idx > p->n) return luaL_error(L, "index out of bounds: " MATRIX_SIZE_FMT, matrix_size_arg(idx));
+        lua_pushinteger(L, p->i[idx - 1] + 1);
+        return 1;
+    }
+    luaL_getmetatable(L, MATRIX_INDEX_MT);
+    lua_getfield(L, -1, luaL_checkstring(L, 2));
+    return 1;
+}
+
+#ifdef MATRIX_ENABLE_RNG
+/**
+ * p = r:perm(n, k) returns the first k (default n) elements of a random permutation of 1..n,
+ * for shuffling or sampling rows without repetition (partial Fisher-Yates)
+ */
+static int matrix_rng_perm(lua_State * L) {
+    struct MatrixRng * r = (struct MatrixRng*)luaL_checkudata(L, 1, MATRIX_RNG_MT);
+    matrix_size_t n = luaL_checkinteger(L, 2);
+    matrix_size_t k = luaL_optinteger(L, 3, n), i;
+    if (n < 0 || k < 0 || k > n) return luaL_error(L, "invalid permutation size " MATRIX_SIZE_FMT " of " MATRIX_SIZE_FMT, matrix_size_arg(k), matrix_size_arg(n));
+    struct MatrixIndex * p = push_index(L, n);
+    for (i = 0; i < n; i++) p->i[i] = i;
+    for (i = 0; i < k; i++) {
+        uint64_t word = matrix_rng_word(r, i), range = (uint64_t)(n - i);
+        // multiply-shift while the range fits in 32 bits, a modulo (with negligible bias) beyond
+        matrix_size_t j = i + (matrix_size_t)(range >> 32 ? word % range : ((word >> 32) * range) >> 32);
+        matrix_size_t t = p->i[i];
+        p->i[i] = p->i[j];
+        p->i[j] = t;
+    }
+    r->counter += k;
+    p->n = k; // the rest of the permutation is left unused
+    return 1;
+}
+#endif
+#endif
+
+#ifdef MATRIX_ENABLE_RESHAPE
+static int matrix_mt_reshape(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    matrix_size_t rows = luaL_checkinteger(L, 2);
+    matrix_size_t cols = luaL_checkinteger(L, 3);
+    if (rows < 1 || cols < 1 || rows > m->rows*m->cols / cols || rows*cols != m->rows*m->cols)
+        return luaL_error(L, "invalid reshape size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(rows), matrix_size_arg(cols));
+    m->rows = rows;
+    m->cols = cols;
+    return 0;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_T
+static int matrix_mt_t(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * dest = push_matrix(L, m->cols, m->rows);
+    matrix_kernels->transpose(m->rows, m->cols, m->d, m->rows, dest->d);
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_DOT
+static int matrix_mt_dot(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * p = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    if (m->cols != p->rows)
+        return luaL_error(L, "non-conformant matrix multiplication " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " by " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(m->rows), matrix_size_arg(m->cols), matrix_size_arg(p->rows), matrix_size_arg(p->cols));
+    struct Matrix * dest = push_matrix(L, m->rows, p->cols);
+    matrix_op_gemm(m->rows, p->cols, m->cols, 1, m->d, m->rows, p->d, p->rows, 0, dest->d, dest->rows);
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_TDOT
+static int matrix_mt_tdot(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * p = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    if (m->rows != p->rows)
+        return luaL_error(L, "non-conformant operands for tdot " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " by " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(m->rows), matrix_size_arg(m->cols), matrix_size_arg(p->rows), matrix_size_arg(p->cols));
+    struct Matrix * dest = push_matrix(L, m->cols, p->cols);
+    matrix_op_gemm_tn(m->cols, p->cols, m->rows, 1, m->d, m->rows, p->d, p->rows, 0, dest->d, dest->rows);
+    return 1;
+}
+#endif
+
+#if defined(MATRIX_ENABLE_RSWAP) || defined(MATRIX_ENABLE_LUP)
+static void matrix_op_rswap(struct Matrix * m, matrix_size_t r1, matrix_size_t r2) {
+    matrix_size_t limit = m->rows * m->cols;
+    for (; r1 < limit; r1 += m->rows, r2 += m->rows) {
+        MATRIX_TYPE t = m->d[r1];
+        m->d[r1] = m->d[r2];
+        m->d[r2] = t;
+    }
+}
+#endif
+
+#ifdef MATRIX_ENABLE_RSWAP
+static int matrix_mt_rswap(lua_State * L) {
+    struct Matrix * m = matrix_checkwritable(L, 1);
+    matrix_size_t r1 = luaL_checkinteger(L, 2);
+    matrix_size_t r2 = luaL_checkinteger(L, 3);
+    if (r1 < 1 || r2 < 1 || r1 > m->rows || r2 > m->rows)
+        return luaL_error(L, "invalid row indices for rswap: " MATRIX_SIZE_FMT ", " MATRIX_SIZE_FMT, matrix_size_arg(r1), matrix_size_arg(r2));
+    if (r1 == r2) return 0;
+    matrix_op_rswap(m, r1 - 1, r2 - 1);
+    return 0;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_CSWAP
+static void matrix_cswap(struct Matrix * m, matrix_size_t c1, matrix_size_t c2) {
+    matrix_size_t cursor1 = (c1 - 1) * m->rows, cursor2 = (c2 - 1) * m->rows;
+    matrix_size_t i;
+    for (i = 0; i < m->rows; i++, cursor1++, cursor2++) {
+        MATRIX_TYPE t = m->d[cursor1];
+        m->d[cursor1] = m->d[cursor2];
+        m->d[cursor2] = t;
+    }
+}
+
+static int matrix_mt_cswap(lua_State * L) {
+    struct Matrix * m = matrix_checkwritable(L, 1);
+    matrix_size_t c1 = luaL_checkinteger(L, 2);
+    matrix_size_t c2 = luaL_checkinteger(L, 3);
+    if (c1 < 1 || c2 < 1 || c1 > m->cols || c2 > m->cols)
+        return luaL_error(L, "invalid column indices for cswap: " MATRIX_SIZE_FMT ", " MATRIX_SIZE_FMT, matrix_size_arg(c1), matrix_size_arg(c2));
+    if (c1 == c2) return 0;
+    matrix_cswap(m, c1, c2);
+    return 0;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_LUP
+/**
+ * in place LU factorization of the n*n matrix upper, with L's multipliers left below the
+ * diagonal and the row permutation stored in p. Returns the number of row swaps, or -1 for
+ * degenerate matrices (a pivot below tolerance).
+ */
+static int matrix_op_lup(struct Matrix * upper, matrix_size_t * p, MATRIX_TYPE tolerance) {
+    int swaps = 0;
+    matrix_size_t i, j, k, n = upper->rows;
+    matrix_size_t size = n*n;
+    for (i = 0; i < n; i++) p[i] = i;
+    matrix_size_t i_as_column_offset = 0;
+    for (i = 0; i < n; i++, i_as_column_offset += n) {
+        matrix_size_t maxi = i;
+        MATRIX_TYPE maxabs = MATRIX_ABS_OP(upper->d[i_as_column_offset + i]);
+        for (k = i + 1; k < n; k++) {
+            MATRIX_TYPE abs_k = MATRIX_ABS_OP(upper->d[i_as_column_offset + k]);
+            if (abs_k > maxabs) {
+                maxabs = abs_k;
+                maxi = k;
+            }
+        }
+        if (maxabs < tolerance) return -1;
+        if (i != maxi) {
+            matrix_size_t t = p[i];
+            p[i] = p[maxi];
+            p[maxi] = t;
+            matrix_op_rswap(upper, i, maxi);
+            swaps++;
+        }
+        for (j = i + 1; j < n; j++) {
+            MATRIX_TYPE pivot = (upper->d[j + i_as_column_offset] /= upper->d[i + i_as_column_offset]);
+            for (k = i_as_column_offset + n; k < size; k += n) {
+                upper->d[j + k] -= pivot * upper->d[i + k];
+            }
+        }
+    }
+    return swaps;
+}
+
+/**
+ * completes the lup result table at the top of the stack (which already has U) with
+ * L, p, P, swaps and det, splitting L's multipliers out of upper.
+ */
+static void matrix_lup_finish(lua_State * L, struct Matrix * upper, const matrix_size_t * p, int swaps, int compact) {
+    matrix_size_t i, j, n = upper->rows, size = n*n, i_as_column_offset;
+    struct Matrix * lower = push_matrix(L, n, n);
+    // build L as copy of U's lower part, setting zeros in U's lower triangle, L's upper triangle
+    //       and ones into L's diagonal
+    for (i = 0, i_as_column_offset = 0; i < n; i++, i_as_column_offset += n) {
+        for (j = 0; j < i; j++) { // upper triangle
+            lower->d[i_as_column_offset + j] = 0;
+        }
+        lower->d[i_as_column_offset + i] = 1; // diagonal
+        for (j = i + 1; j < n; j++) { // lower triangle
+            lower->d[i_as_column_offset + j] = upper->d[i_as_column_offset + j];
+            upper->d[i_as_column_offset + j] = 0;
+        }
+    }
+    lua_setfield(L, -2, "L");
+    // setting p table as copy of p:
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        lua_pushinteger(L, p[i] + 1);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_setfield(L, -2, "p");
+#ifdef MATRIX_ENABLE_INDEX
+    if (compact) { // P as an index, P:apply(m) being the same as the dense P:dot(m)
+        struct MatrixIndex * perm = push_index(L, n);
+        memcpy(perm->i, p, sizeof (matrix_size_t[n]));
+        lua_setfield(L, -2, "P");
+    } else
+#endif
+    {
+        struct Matrix * perm = push_matrix(L, n, n);
+        // and P matrix as the permutation matrix corresponding to p:
+        for (i = 0; i < size; i++) perm->d[i] = 0;
+        for (i = 0; i < n; i++) perm->d[i + p[i]*n] = 1;
+        lua_setfield(L, -2, "P");
+    }
+    // setting swaps into returned table:
+    lua_pushinteger(L, swaps);
+    lua_setfield(L, -2, "swaps");
+    // return determinant as well:
+    MATRIX_TYPE det = swaps&1 ? -1 : 1;
+    for (i = 0; i < size; i += n + 1) det *= upper->d[i];
+    lua_pushnumber(L, det);
+    lua_setfield(L, -2, "det");
+}
+
+static int matrix_mt_lup(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    MATRIX_TYPE tolerance = luaL_optnumber(L, 2, 1e-38);
+    int compact = lua_toboolean(L, 3);
+    int swaps;
+    matrix_size_t n = m->rows;
+    if (n != m->cols) return luaL_error(L, "square matrix required");
+    matrix_size_t * p = (matrix_size_t *)lua_newuserdata(L, sizeof (matrix_size_t[n])); // scratch, below the result
+    lua_createtable(L, 0, 4); //{L=..., U=..., p=ptable, swaps=integer}
+    // u starts as a copy of m:
+    struct Matrix * upper = push_matrix(L, n, n);
+    memcpy(upper->d, m->d, sizeof (MATRIX_TYPE[n*n]));
+    lua_setfield(L, -2, "U");
+    swaps = matrix_op_lup(upper, p, tolerance);
+    if (swaps < 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "degenerate matrix");
+        return 2;
+    }
+    matrix_lup_finish(L, upper, p, swaps, compact);
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_RREF
+/**
+ * reduces mcopy in place to its RREF, applying the same row operations to inv
+ * (when not NULL, it should start as the identity to end up as mcopy's inverse)
+ */
+static void matrix_op_rref(struct Matrix * mcopy, struct Matrix * inv, MATRIX_TYPE tolerance) {
+    MATRIX_TYPE pivot;
+    matrix_size_t i, j, k, i_as_column_offset, w = mcopy->cols, h = mcopy->rows;
+    matrix_size_t size = w*h;
+    for (i = 0, i_as_column_offset = 0; i < h && i_as_column_offset < size; i_as_column_offset += h) {
+        matrix_size_t maxi = i;
+        MATRIX_TYPE maxabs = MATRIX_ABS_OP(mcopy->d[i_as_column_offset + i]);
+        for (k = i + 1; k < h; k++) {
+            MATRIX_TYPE abs_k = MATRIX_ABS_OP(mcopy->d[i_as_column_offset + k]);
+            if (abs_k > maxabs) {
+                maxabs = abs_k;
+                maxi = k;
+            }
+        }
+        if (maxabs < tolerance) continue;
+        if (i != maxi) {
+            matrix_op_rswap(mcopy, i, maxi);
+            if (inv) matrix_op_rswap(inv, i, maxi);
+        }
+        // normalize ith-row
+        pivot = mcopy->d[i_as_column_offset + i];
+        mcopy->d[i_as_column_offset + i] = 1;
+        for (k = i_as_column_offset + h; k < size; k += h) mcopy->d[k + i] /= pivot;
+        if (inv) {
+            for (k = i; k < size; k += h) inv->d[k] /= pivot;
+        }
+        // normalize remaining rows:
+        for (j = 0; j < h; j++) {
+            if (j == i) continue;
+            pivot = mcopy->d[j + i_as_column_offset];
+            if (pivot == 0) continue;
+            for (k = i_as_column_offset + h; k < size; k += h) mcopy->d[j+k] -= pivot * mcopy->d[i+k];
+            if (inv) {
+                for (k = 0; k < size; k += h) inv->d[j+k] -= pivot * inv->d[i+k];
+            }
+            mcopy->d[j + i_as_column_offset] = 0;
+        }
+        i++;
+    }
+}
+
+static int matrix_mt_rref(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    MATRIX_TYPE tolerance = luaL_optnumber(L, 2, 1e-38);
+    matrix_size_t w = m->cols, h = m->rows;
+    struct Matrix * inv = w==h ? push_id_matrix(L, w) : NULL;
+    struct Matrix * mcopy = push_matrix(L, h, w);
+    memcpy(mcopy->d, m->d, sizeof (MATRIX_TYPE[w*h]));
+    matrix_op_rref(mcopy, inv, tolerance);
+    if (inv) {
+        lua_insert(L, -2); // swapped to return rref, inv
+        return 2;
+    }
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_INV
+static int matrix_mt_inv(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    if (m->rows != m->cols) return luaL_error(L, "square matrix required");
+    return matrix_mt_rref(L) - 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_QR
+/**
+ * Householder vector for x = a[0..n-1]: on return a[0] holds beta, a[1..n-1] the vector v
+ * scaled so that v[0] = 1 (implicit), and H = I - tau*v*v' satisfies H*x = (beta, 0, ..., 0).
+ */
+static MATRIX_TYPE matrix_op_householder(matrix_size_t n, MATRIX_TYPE * a) {
+    MATRIX_TYPE alpha = a[0], xnorm = 0, beta, scale;
+    matrix_size_t i;
+    for (i = 1; i < n; i++) xnorm += a[i] * a[i];
+    if (xnorm == 0) return 0;
+    beta = sqrt(alpha * alpha + xnorm);
+    if (alpha > 0) beta = -beta;
+    scale = 1 / (alpha - beta);
+    for (i = 1; i < n; i++) a[i] *= scale;
+    a[0] = beta;
+    return (beta - alpha) / beta;
+}
+
+// applies H = I - tau*v*v' to the n columns of c (rows from 0 to m-1), v[0] = 1 is implicit
+static void matrix_op_householder_apply(matrix_size_t m, matrix_size_t n, const MATRIX_TYPE * v, MATRIX_TYPE tau,
+        MATRIX_TYPE * c, matrix_size_t ldc) {
+    matrix_size_t i, j;
+    if (tau == 0) return;
+    for (j = 0; j < n; j++, c += ldc) {
+        MATRIX_TYPE w = c[0];
+        for (i = 1; i < m; i++) w += v[i] * c[i];
+        w *= tau;
+        c[0] -= w;
+        for (i = 1; i < m; i++) c[i] -= w * v[i];
+    }
+}
+
+/**
+ * Blocked Householder QR of the h*w matrix a, in place: R ends up in the upper triangle and the
+ * Householder vectors below the diagonal (LAPACK's geqrf layout). Each panel of MATRIX_QR_BLOCK
+ * columns is factorized column by column and then applied to the trailing columns as one block
+ * reflector I - V*T*V' (compact WY), so that most of the work goes through matrix_op_gemm.
+ * The scratch buffers are a userdata, pushed and popped here.
+ */
+static void matrix_op_qr(lua_State * L, struct Matrix * a, MATRIX_TYPE * tau) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    matrix_size_t h = a->rows, w = a->cols, k = h < w ? h : w;
+    matrix_size_t nb = MATRIX_QR_BLOCK;
+    matrix_size_t i, j, l, j0;
+    MATRIX_TYPE * v = (MATRIX_TYPE *)lua_newuserdata(L, sizeof (MATRIX_TYPE[h * nb + nb * nb + nb * w]));
+    MATRIX_TYPE * t = v + h * nb, * work = t + nb * nb;
+    for (j0 = 0; j0 < k; j0 += nb) {
+        matrix_size_t jb = k - j0 < nb ? k - j0 : nb;
+        matrix_size_t mc = h - j0, nc = w - j0 - jb;
+        MATRIX_TYPE * panel = a->d + j0 * h + j0;
+        for (j = 0; j < jb; j++) {
+            MATRIX_TYPE * col = panel + j * h + j;
+            tau[j0 + j] = matrix_op_householder(mc - j, col);
+            matrix_op_householder_apply(mc - j, jb - j - 1, col, tau[j0 + j], col + h, h);
+        }
+        if (nc == 0) continue;
+        // V: explicit copy of the panel vectors, unit diagonal and zeros above it
+        for (j = 0; j < jb; j++) {
+            for (i = 0; i < j; i++) v[j * mc + i] = 0;
+            v[j * mc + j] = 1;
+            for (i = j + 1; i < mc; i++) v[j * mc + i] = panel[j * h + i];
+        }
+        // T: upper triangular with H(1)*...*H(jb) = I - V*T*V'
+        for (j = 0; j < jb; j++) {
+            t[j * nb + j] = tau[j0 + j];
+            for (l = 0; l < j; l++) {
+                MATRIX_TYPE dot = 0;
+                for (i = j; i < mc; i++) dot += v[l * mc + i] * v[j * mc + i];
+                work[l] = -tau[j0 + j] * dot;
+            }
+            for (l = 0; l < j; l++) {
+                MATRIX_TYPE res = 0;
+                for (i = l; i < j; i++) res += t[i * nb + l] * work[i];
+                t[j * nb + l] = res;
+            }
+        }
+        // C = (I - V*T'*V') * C, as W = V'*C; W = T'*W; C -= V*W
+        MATRIX_TYPE * c = panel + jb * h;
+        kernels->gemm_tn(jb, nc, mc, 1, v, mc, c, h, 0, work, jb);
+        for (j = 0; j < nc; j++) {
+            MATRIX_TYPE * wcol = work + j * jb;
+            for (i = jb - 1; i >= 0; i--) {
+                MATRIX_TYPE res = 0;
+                for (l = 0; l <= i; l++) res += t[i * nb + l] * wcol[l];
+                wcol[i] = res;
+            }
+        }
+        kernels->gemm(mc, nc, jb, -1, v, mc, work, jb, 1, c, h);
+    }
+    lua_pop(L, 1);
+}
+
+/**
+ * least squares solution of R*x = Q'*b given the factorization in h and tau,
+ * pushes x or nil plus an error message (the number of pushed values is returned).
+ */
+static int matrix_op_qr_solve(lua_State * L, struct Matrix * h, const MATRIX_TYPE * tau,
+        struct Matrix * b, MATRIX_TYPE tolerance) {
+    matrix_size_t m = h->rows, n = h->cols, i, j, l;
+    MATRIX_TYPE rmax = 0;
+    if (m < n) return luaL_error(L, "least squares requires rows >= cols, got " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(m), matrix_size_arg(n));
+    if (b->rows != m)
+        return luaL_error(L, "non-conformant right hand side " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " for " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " system", matrix_size_arg(b->rows), matrix_size_arg(b->cols), matrix_size_arg(m), matrix_size_arg(n));
+    for (i = 0; i < n; i++) {
+        MATRIX_TYPE r = MATRIX_ABS_OP(h->d[i * m + i]);
+        if (r > rmax) rmax = r;
+    }
+    for (i = 0; i < n; i++) {
+        if (MATRIX_ABS_OP(h->d[i * m + i]) <= tolerance * rmax || rmax == 0) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "rank deficient matrix");
+            return 2;
+        }
+    }
+    struct Matrix * y = push_matrix(L, m, b->cols);
+    memcpy(y->d, b->d, sizeof (MATRIX_TYPE[m * b->cols]));
+    for (i = 0; i < n; i++)
+        matrix_op_householder_apply(m - i, b->cols, h->d + i * m + i, tau[i], y->d + i, m);
+    struct Matrix * x = push_matrix(L, n, b->cols);
+    for (j = 0; j < b->cols; j++) {
+        MATRIX_TYPE * xcol = x->d + j * n, * ycol = y->d + j * m;
+        for (i = n - 1; i >= 0; i--) {
+            MATRIX_TYPE res = ycol[i];
+            for (l = i + 1; l < n; l++) res -= h->d[l * m + i] * xcol[l];
+            xcol[i] = res / h->d[i * m + i];
+        }
+    }
+    lua_remove(L, -2); // discard y
+    return 1;
+}
+
+#define MATRIX_QR_TOLERANCE(m) ((m)->rows * MATRIX_EPSILON)
+
+// x = qr:solve(b, tolerance)
+static int matrix_qr_solve(lua_State * L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    struct Matrix * b = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    lua_settop(L, 3);
+    lua_getfield(L, 1, "H");
+    struct Matrix * h = (struct Matrix*)luaL_checkudata(L, -1, MATRIX_MT);
+    lua_getfield(L, 1, "tau");
+    struct Matrix * tau = (struct Matrix*)luaL_checkudata(L, -1, MATRIX_MT);
+    return matrix_op_qr_solve(L, h, tau->d, b, luaL_optnumber(L, 3, MATRIX_QR_TOLERANCE(h)));
+}
+
+// Q = qr:Q(), the thin h*min(h,w) orthogonal factor
+static int matrix_qr_q(lua_State * L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "H");
+    struct Matrix * h = (struct Matrix*)luaL_checkudata(L, -1, MATRIX_MT);
+    lua_getfield(L, 1, "tau");
+    struct Matrix * tau = (struct Matrix*)luaL_checkudata(L, -1, MATRIX_MT);
+    matrix_size_t m = h->rows, k = tau->rows, i;
+    struct Matrix * q = push_matrix(L, m, k);
+    for (i = 0; i < m * k; i++) q->d[i] = 0;
+    for (i = 0; i < k; i++) q->d[i * m + i] = 1;
+    // Q = H(1)*...*H(k)*I, applied backwards so that only the trailing block is touched
+    for (i = k - 1; i >= 0; i--)
+        matrix_op_householder_apply(m - i, k - i, h->d + i * m + i, tau->d[i], q->d + i * m + i, m);
+    return 1;
+}
+
+/**
+ * qr = m:qr() returns a table with:
+ *   qr.R (min(h,w)*w upper triangular), qr.H and qr.tau (compact factorization),
+ *   qr:Q() and qr:solve(b).
+ */
+static int matrix_mt_qr(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    matrix_size_t h = m->rows, w = m->cols, k = h < w ? h : w, i, j;
+    lua_createtable(L, 0, 5);
+    struct Matrix * fact = push_matrix(L, h, w);
+    memcpy(fact->d, m->d, sizeof (MATRIX_TYPE[h * w]));
+    lua_setfield(L, -2, "H");
+    struct Matrix * tau = push_matrix(L, k, 1);
+    lua_setfield(L, -2, "tau");
+    matrix_op_qr(L, fact, tau->d);
+    struct Matrix * r = push_matrix(L, k, w);
+    for (j = 0; j < w; j++) {
+        for (i = 0; i < k; i++) r->d[j * k + i] = i <= j ? fact->d[j * h + i] : 0;
+    }
+    lua_setfield(L, -2, "R");
+    lua_pushcfunction(L, &matrix_qr_q);
+    lua_setfield(L, -2, "Q");
+    lua_pushcfunction(L, &matrix_qr_solve);
+    lua_setfield(L, -2, "solve");
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_LSTSQ
+// x = m:lstsq(b, tolerance), minimizing |m*x - b| through the QR factorization of m
+static int matrix_mt_lstsq(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * b = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    MATRIX_TYPE tolerance = luaL_optnumber(L, 3, MATRIX_QR_TOLERANCE(m));
+    if (m->rows < m->cols)
+        return luaL_error(L, "least squares requires rows >= cols, got " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(m->rows), matrix_size_arg(m->cols));
+    if (b->rows != m->rows)
+        return luaL_error(L, "non-conformant right hand side " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " for " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " system", matrix_size_arg(b->rows), matrix_size_arg(b->cols), matrix_size_arg(m->rows), matrix_size_arg(m->cols));
+    struct Matrix * fact = push_matrix(L, m->rows, m->cols);
+    memcpy(fact->d, m->d, sizeof (MATRIX_TYPE[m->rows * m->cols]));
+    struct Matrix * tau = push_matrix(L, m->cols, 1);
+    matrix_op_qr(L, fact, tau->d);
+    return matrix_op_qr_solve(L, fact, tau->d, b, tolerance);
+}
+#endif
+
+#ifdef MATRIX_ENABLE_CONV2D
+/**
+ * out = m:conv2d(kernel, {stride=s, padding=p, mode="valid"|"same"|"full", flip=false})
+ * outs = matrix.conv2d(channels, filters, opts)
+ *
+ * Cross-correlation (as used by CNN layers), or true convolution when flip is set. Filters with
+ * less than MATRIX_CONV2D_IM2COL_MIN taps are applied directly, one tap at a time over whole
+ * output columns with the axpy kernel; bigger ones are unfolded into a patch matrix (im2col)
+ * multiplied by the kernels with matrix_op_gemm.
+ */
+struct MatrixConv {
+    matrix_size_t h, w;       // input size
+    matrix_size_t kh, kw;     // kernel size
+    matrix_size_t sr, sc;     // strides
+    matrix_size_t pr, pc;     // zero padding before the first row and column
+    matrix_size_t oh, ow;     // output size
+    int flip;
+};
+
+// reads a number or a {rows, cols} pair from opts[key]
+static void matrix_conv2d_pair(lua_State * L, int opts, const char * key, matrix_size_t def, matrix_size_t * r, matrix_size_t * c) {
+    *r = *c = def;
+    if (lua_isnoneornil(L, opts)) return;
+    lua_getfield(L, opts, key);
+    if (lua_istable(L, -1)) {
+        lua_geti(L, -1, 1);
+        *r = luaL_checkinteger(L, -1);
+        lua_geti(L, -2, 2);
+        *c = luaL_checkinteger(L, -1);
+        lua_pop(L, 2);
+    } else if (!lua_isnil(L, -1)) {
+        *r = *c = luaL_checkinteger(L, -1);
+    }
+    lua_pop(L, 1);
+}
+
+static void matrix_conv2d_geometry(lua_State * L, int opts, struct MatrixConv * g) {
+    static const char * const modes[] = {"valid", "same", "full", NULL};
+    int mode = 0;
+    matrix_size_t padr, padc;
+    if (!lua_isnoneornil(L, opts)) {
+        luaL_checktype(L, opts, LUA_TTABLE);
+        lua_getfield(L, opts, "mode");
+        mode = luaL_checkoption(L, -1, "valid", modes);
+        lua_getfield(L, opts, "flip");
+        g->flip = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+    } else g->flip = 0;
+    matrix_conv2d_pair(L, opts, "stride", 1, &g->sr, &g->sc);
+    matrix_conv2d_pair(L, opts, "padding", 0, &padr, &padc);
+    if (g->sr < 1 || g->sc < 1 || padr < 0 || padc < 0)
+        luaL_error(L, "invalid conv2d stride " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " or padding " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(g->sr), matrix_size_arg(g->sc), matrix_size_arg(padr), matrix_size_arg(padc));
+    // total padding on both sides, before plus after:
+    matrix_size_t tr = 2 * padr + (mode == 0 ? 0 : g->kh - 1);
+    matrix_size_t tc = 2 * padc + (mode == 0 ? 0 : g->kw - 1);
+    g->pr = padr + (mode == 1 ? (g->kh - 1) / 2 : mode == 2 ? g->kh - 1 : 0);
+    g->pc = padc + (mode == 1 ? (g->kw - 1) / 2 : mode == 2 ? g->kw - 1 : 0);
+    if (g->h + tr < g->kh || g->w + tc < g->kw)
+        luaL_error(L, "conv2d kernel " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " bigger than the padded " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " input", matrix_size_arg(g->kh), matrix_size_arg(g->kw), matrix_size_arg(g->h + tr), matrix_size_arg(g->w + tc));
+    g->oh = (g->h + tr - g->kh) / g->sr + 1;
+    g->ow = (g->w + tc - g->kw) / g->sc + 1;
+}
+
+// range of output indices [*o1, *o2) whose input index o*stride + tap - pad lies in [0, n)
+static void matrix_conv2d_range(matrix_size_t n, matrix_size_t stride, matrix_size_t tap, matrix_size_t pad, matrix_size_t outn, matrix_size_t * o1, matrix_size_t * o2) {
+    matrix_size_t first = pad - tap; // o*stride >= first
+    matrix_size_t last = n - 1 + pad - tap; // o*stride <= last
+    *o1 = first <= 0 ? 0 : (first + stride - 1) / stride;
+    *o2 = last < 0 ? 0 : last / stride + 1;
+    if (*o2 > outn) *o2 = outn;
+}
+
+// out (+)= correlation of in with k, both column major with g's sizes
+static void matrix_op_conv2d_direct(const struct MatrixConv * g, const MATRIX_TYPE * in,
+        const MATRIX_TYPE * k, MATRIX_TYPE * out, int accumulate) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    matrix_size_t a, b, i, j;
+    if (!accumulate) {
+        for (i = 0; i < g->oh * g->ow; i++) out[i] = 0;
+    }
+    for (b = 0; b < g->kw; b++) {
+        matrix_size_t j1, j2;
+        matrix_conv2d_range(g->w, g->sc, b, g->pc, g->ow, &j1, &j2);
+        for (a = 0; a < g->kh; a++) {
+            matrix_size_t i1, i2;
+            MATRIX_TYPE tap = g->flip ? k[(g->kh - 1 - a) + (g->kw - 1 - b) * g->kh] : k[a + b * g->kh];
+            if (tap == 0) continue;
+            matrix_conv2d_range(g->h, g->sr, a, g->pr, g->oh, &i1, &i2);
+            if (i1 >= i2) continue;
+            // input row and column of output (i1, j), within the input by matrix_conv2d_range
+            matrix_size_t row = i1 * g->sr + a - g->pr;
+            for (j = j1; j < j2; j++) {
+                matrix_size_t col = j * g->sc + b - g->pc;
+                kernels->axpy(i2 - i1, tap, in + col * g->h + row, g->sr, out + j * g->oh + i1);
+            }
+        }
+    }
+}
+
+/**
+ * writes the patches for output columns j0 to j0+nj-1 of in into the columns
+ * p[tap*ldp] (tap = a + b*kh), one row per output pixel.
+ */
+static void matrix_op_im2col(const struct MatrixConv * g, const MATRIX_TYPE * in, matrix_size_t j0, matrix_size_t nj,
+        MATRIX_TYPE * p, matrix_size_t ldp) {
+    matrix_size_t a, b, i, j;
+    for (b = 0; b < g->kw; b++) {
+        matrix_size_t j1, j2;
+        matrix_conv2d_range(g->w, g->sc, b, g->pc, g->ow, &j1, &j2);
+        for (a = 0; a < g->kh; a++) {
+            matrix_size_t i1, i2;
+            MATRIX_TYPE * col = p + (a + b * g->kh) * ldp;
+            matrix_conv2d_range(g->h, g->sr, a, g->pr, g->oh, &i1, &i2);
+            for (j = j0; j < j0 + nj; j++) {
+                MATRIX_TYPE * o = col + (j - j0) * g->oh;
+                if (j < j1 || j >= j2) {
+                    for (i = 0; i < g->oh; i++) o[i] = 0;
+                    continue;
+                }
+                for (i = 0; i < i1; i++) o[i] = 0;
+                if (i1 < i2) {
+                    const MATRIX_TYPE * src = in + (j * g->sc + b - g->pc) * g->h + i1 * g->sr + a - g->pr;
+                    for (; i < i2; i++) o[i] = src[(i - i1) * g->sr];
+                }
+                for (; i < g->oh; i++) o[i] = 0;
+            }
+        }
+    }
+}
+
+/**
+ * out[b][f] = sum over c of in[b][c] correlated with k[f][c], with nb images of nc channels and
+ * nf filters. in, k and out are arrays of matrix data pointers indexed as shown. The im2col
+ * buffers are a userdata, pushed and popped here.
+ */
+static void matrix_op_conv2d(lua_State * L, const struct MatrixConv * g, matrix_size_t nb, matrix_size_t nc, matrix_size_t nf,
+        MATRIX_TYPE ** in, MATRIX_TYPE ** k, MATRIX_TYPE ** out) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    matrix_size_t taps = g->kh * g->kw, b, c, f, j;
+    if (taps * nc < MATRIX_CONV2D_IM2COL_MIN) {
+        for (b = 0; b < nb; b++) {
+            for (f = 0; f < nf; f++) {
+                for (c = 0; c < nc; c++)
+                    matrix_op_conv2d_direct(g, in[b * nc + c], k[f * nc + c], out[b * nf + f], c > 0);
+            }
+        }
+        return;
+    }
+    // weights: one column per filter, rows following the im2col tap order for each channel
+    matrix_size_t depth = taps * nc, t;
+    // output columns are processed in chunks, bounding the patch matrix size
+    matrix_size_t nj = MATRIX_CONV2D_CHUNK / (g->oh * depth);
+    if (nj < 1) nj = 1;
+    if (nj > g->ow) nj = g->ow;
+    MATRIX_TYPE * wt = (MATRIX_TYPE *)lua_newuserdata(L, sizeof (MATRIX_TYPE[depth * nf + g->oh * nj * (depth + nf)]));
+    MATRIX_TYPE * p = wt + depth * nf, * o = p + g->oh * nj * depth;
+    for (f = 0; f < nf; f++) {
+        for (c = 0; c < nc; c++) {
+            const MATRIX_TYPE * kd = k[f * nc + c];
+            for (t = 0; t < taps; t++)
+                wt[f * depth + c * taps + t] = g->flip ? kd[taps - 1 - t] : kd[t];
+        }
+    }
+    for (b = 0; b < nb; b++) {
+        for (j = 0; j < g->ow; j += nj) {
+            matrix_size_t cols = g->ow - j < nj ? g->ow - j : nj, rows = g->oh * cols;
+            for (c = 0; c < nc; c++)
+                matrix_op_im2col(g, in[b * nc + c], j, cols, p + c * taps * rows, rows);
+            kernels->gemm(rows, nf, depth, 1, p, rows, wt, depth, 0, o, rows);
+            for (f = 0; f < nf; f++)
+                memcpy(out[b * nf + f] + j * g->oh, o + f * rows, sizeof (MATRIX_TYPE[rows]));
+        }
+    }
+    lua_pop(L, 1);
+}
+
+static int matrix_mt_conv2d(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * k = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    struct MatrixConv g;
+    g.h = m->rows; g.w = m->cols;
+    g.kh = k->rows; g.kw = k->cols;
+    matrix_conv2d_geometry(L, 3, &g);
+    struct Matrix * dest = push_matrix(L, g.oh, g.ow);
+    MATRIX_TYPE * in = m->d, * kd = k->d, * out = dest->d;
+    matrix_op_conv2d(L, &g, 1, 1, 1, &in, &kd, &out);
+    return 1;
+}
+
+/**
+ * collects the matrices of the list at index idx into d (which has room for n pointers),
+ * checking that they share the same size (stored in *rows, *cols unless they are already set)
+ */
+static void matrix_conv2d_list(lua_State * L, int idx, matrix_size_t n, MATRIX_TYPE ** d, matrix_size_t * rows, matrix_size_t * cols) {
+    matrix_size_t i;
+    for (i = 0; i < n; i++) {
+        lua_geti(L, idx, i + 1);
+        struct Matrix * m = (struct Matrix*)luaL_checkudata(L, -1, MATRIX_MT);
+        if (*rows == 0) {
+            *rows = m->rows;
+            *cols = m->cols;
+        } else if (m->rows != *rows || m->cols != *cols) {
+            luaL_error(L, "conv2d expects " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrices, got " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(*rows), matrix_size_arg(*cols), matrix_size_arg(m->rows), matrix_size_arg(m->cols));
+        }
+        d[i] = m->d;
+        lua_pop(L, 1); // still referenced by the list
+    }
+}
+
+/**
+ * outs = matrix.conv2d(channels, filters, opts), where channels is a list of equally sized
+ * matrices (or a list of such lists, for a batch of images) and filters is a list of lists of
+ * kernels, one for each channel. Returns one output matrix per filter (per image).
+ */
+static int matrix_conv2d(lua_State * L) {
+    struct MatrixConv g;
+    matrix_size_t nb, nc, nf, b, f;
+    int batch;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    batch = lua_geti(L, 1, 1) == LUA_TTABLE;
+    lua_pop(L, 1);
+    nb = batch ? luaL_len(L, 1) : 1;
+    nf = luaL_len(L, 2);
+    lua_geti(L, 2, 1);
+    luaL_checktype(L, -1, LUA_TTABLE);
+    nc = luaL_len(L, -1);
+    lua_pop(L, 1);
+    if (nb < 1 || nf < 1 || nc < 1) return luaL_error(L, "conv2d requires non empty lists");
+    // pointer arrays as a userdata, so that they are collected if any check fails
+    MATRIX_TYPE ** in = lua_newuserdata(L, sizeof (MATRIX_TYPE *[nb * nc + nf * nc + nb * nf]));
+    MATRIX_TYPE ** k = in + nb * nc, ** out = k + nf * nc;
+    g.h = g.w = g.kh = g.kw = 0;
+    for (b = 0; b < nb; b++) {
+        if (batch) lua_geti(L, 1, b + 1); else lua_pushvalue(L, 1);
+        if (!lua_istable(L, -1) || luaL_len(L, -1) != nc)
+            return luaL_error(L, "conv2d expects " MATRIX_SIZE_FMT " channels per image", matrix_size_arg(nc));
+        matrix_conv2d_list(L, lua_gettop(L), nc, in + b * nc, &g.h, &g.w);
+        lua_pop(L, 1);
+    }
+    for (f = 0; f < nf; f++) {
+        lua_geti(L, 2, f + 1);
+        if (!lua_istable(L, -1) || luaL_len(L, -1) != nc)
+            return luaL_error(L, "conv2d expects " MATRIX_SIZE_FMT " kernels per filter", matrix_size_arg(nc));
+        matrix_conv2d_list(L, lua_gettop(L), nc, k + f * nc, &g.kh, &g.kw);
+        lua_pop(L, 1);
+    }
+    matrix_conv2d_geometry(L, 3, &g);
+    lua_createtable(L, nb, 0);
+    for (b = 0; b < nb; b++) {
+        if (batch) lua_createtable(L, nf, 0);
+        for (f = 0; f < nf; f++) {
+            out[b * nf + f] = push_matrix(L, g.oh, g.ow)->d;
+            lua_rawseti(L, -2, f + 1);
+        }
+        if (batch) lua_rawseti(L, -2, b + 1);
+    }
+    matrix_op_conv2d(L, &g, nb, nc, nf, in, k, out);
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_CDIST
+/**
+ * d = matrix.cdist(a, b, {metric="euclidean"|"sqeuclidean"|"cosine"})
+ * dist, ids = matrix.topk(a, b, k, opts)
+ *
+ * Distances between the rows of a (n*dims) and those of b (m*dims): d is n*m with d[{i, j}] the
+ * distance between a's row i and b's row j. Both go through matrix_op_gemm by blocks, computing the
+ * dot products and turning them into distances right away with the precomputed row norms
+ * (|x|^2 + |y|^2 - 2*x·y, or 1 - x·y/(|x|*|y|) for cosine), while the block is still in cache.
+ * topk keeps, for every row of a, a heap with the k nearest rows of b seen so far, so the whole
+ * distance matrix is never stored: dist (n*k) has the distances in increasing order and ids the
+ * 1 based row numbers of b, k consecutive ones per row of a (b:take_rows(ids) are the neighbours).
+ */
+enum { MATRIX_EUCLIDEAN, MATRIX_SQEUCLIDEAN, MATRIX_COSINE };
+
+static int matrix_cdist_metric(lua_State * L, int opts) {
+    static const char * const metrics[] = {"euclidean", "sqeuclidean", "cosine", NULL};
+    int metric;
+    if (lua_isnoneornil(L, opts)) return MATRIX_EUCLIDEAN;
+    luaL_checktype(L, opts, LUA_TTABLE);
+    lua_getfield(L, opts, "metric");
+    metric = luaL_checkoption(L, -1, "euclidean", metrics);
+    lua_pop(L, 1);
+    return metric;
+}
+
+// norms[i] = |row i of m|^2, or 1/|row i| for cosine (0 for null rows)
+static void matrix_cdist_norms(const struct Matrix * m, int metric, MATRIX_TYPE * norms) {
+    matrix_size_t i, k;
+    for (i = 0; i < m->rows; i++) norms[i] = 0;
+    for (k = 0; k < m->cols; k++) {
+        const MATRIX_TYPE * col = m->d + k * m->rows;
+        for (i = 0; i < m->rows; i++) norms[i] += col[i] * col[i];
+    }
+    if (metric == MATRIX_COSINE) {
+        for (i = 0; i < m->rows; i++) norms[i] = norms[i] > 0 ? 1 / sqrt(norms[i]) : 0;
+    }
+}
+
+// turns the n dot products in d into distances, given the norms along d and the one of its column
+static void matrix_cdist_finish(int metric, matrix_size_t n, MATRIX_TYPE * d, const MATRIX_TYPE * norms, MATRIX_TYPE norm) {
+    matrix_size_t i;
+    if (metric == MATRIX_COSINE) {
+        for (i = 0; i < n; i++) d[i] = 1 - d[i] * norms[i] * norm;
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        MATRIX_TYPE v = norms[i] + norm - 2 * d[i];
+        d[i] = v > 0 ? v : 0; // rounding can make it slightly negative
+    }
+    if (metric == MATRIX_EUCLIDEAN) {
+        for (i = 0; i < n; i++) d[i] = sqrt(d[i]);
+    }
+}
+
+/**
+ * dest (n*mb, column j holding the distances from rows i0.. of a to row j0+j of b) with bt the
+ * transposed block of b (dims*mb), na and nb the norms of the rows of a and b
+ */
+static void matrix_op_cdist_block(const struct MatrixKernels * kernels, const struct Matrix * a, matrix_size_t i0, matrix_size_t n, const MATRIX_TYPE * bt,
+        matrix_size_t mb, const MATRIX_TYPE * na, const MATRIX_TYPE * nb, int metric, MATRIX_TYPE * dest, matrix_size_t ldd) {
+    matrix_size_t j;
+    kernels->gemm(n, mb, a->cols, 1, a->d + i0, a->rows, bt, a->cols, 0, dest, ldd);
+    for (j = 0; j < mb; j++) matrix_cdist_finish(metric, n, dest + j * ldd, na + i0, nb[j]);
+}
+
+static void matrix_cdist_check(lua_State * L, const struct Matrix * a, const struct Matrix * b) {
+    if (a->cols != b->cols)
+        luaL_error(L, "distances between rows of " MATRIX_SIZE_FMT " and " MATRIX_SIZE_FMT " columns", matrix_size_arg(a->cols), matrix_size_arg(b->cols));
+}
+
+static int matrix_cdist(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    struct Matrix * a = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * b = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    int metric = matrix_cdist_metric(L, 3);
+    matrix_size_t n = a->rows, m = b->rows, dims = a->cols, bs = MATRIX_CDIST_BLOCK, i, j;
+    matrix_cdist_check(L, a, b);
+    // scratch as a userdata, collected even if push_matrix fails
+    MATRIX_TYPE * na = (MATRIX_TYPE *)lua_newuserdata(L, sizeof (MATRIX_TYPE[n + m + dims * bs]));
+    MATRIX_TYPE * nb = na + n, * bt = nb + m;
+    struct Matrix * dest = push_matrix(L, n, m);
+    matrix_cdist_norms(a, metric, na);
+    matrix_cdist_norms(b, metric, nb);
+    for (j = 0; j < m; j += bs) {
+        matrix_size_t mb = m - j < bs ? m - j : bs;
+        kernels->transpose(mb, dims, b->d + j, m, bt);
+        for (i = 0; i < n; i += bs) {
+            matrix_size_t nr = n - i < bs ? n - i : bs;
+            matrix_op_cdist_block(kernels, a, i, nr, bt, mb, na, nb + j, metric, dest->d + j * n + i, n);
+        }
+    }
+    return 1;
+}
+
+#ifdef MATRIX_ENABLE_INDEX
+// sifts down the root of the max heap of n distances d (and their ids)
+static void matrix_heap_sift(MATRIX_TYPE * d, matrix_size_t * ids, matrix_size_t n) {
+    matrix_size_t i = 0, c;
+    MATRIX_TYPE v = d[0];
+    matrix_size_t id = ids[0];
+    while ((c = 2 * i + 1) < n) {
+        if (c + 1 < n && d[c + 1] > d[c]) c++;
+        if (d[c] <= v) break;
+        d[i] = d[c];
+        ids[i] = ids[c];
+        i = c;
+    }
+    d[i] = v;
+    ids[i] = id;
+}
+
+static int matrix_topk(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    struct Matrix * a = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * b = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    matrix_size_t k = luaL_checkinteger(L, 3);
+    int metric = matrix_cdist_metric(L, 4);
+    matrix_size_t n = a->rows, m = b->rows, dims = a->cols, bs = MATRIX_CDIST_BLOCK, i0, j0, i, j, l;
+    matrix_cdist_check(L, a, b);
+    if (k < 1 || k > m) return luaL_error(L, "invalid k " MATRIX_SIZE_FMT " for " MATRIX_SIZE_FMT " rows", matrix_size_arg(k), matrix_size_arg(m));
+    lua_settop(L, 2);
+    MATRIX_TYPE * na = (MATRIX_TYPE *)lua_newuserdata(L, sizeof (MATRIX_TYPE[n + m + dims * bs + bs * bs]));
+    MATRIX_TYPE * nb = na + n, * at = nb + m, * tile = at + dims * bs;
+    struct Matrix * dist = push_matrix(L, k, n); // heaps, one per column, transposed at the end
+    struct MatrixIndex * ids = push_index(L, matrix_checksize(L, n, k));
+    matrix_cdist_norms(a, metric, na);
+    matrix_cdist_norms(b, metric, nb);
+    for (i0 = 0; i0 < n; i0 += bs) {
+        matrix_size_t nr = n - i0 < bs ? n - i0 : bs;
+        // tiles are b's block times a's transposed block, so that each row of a gets a column
+        kernels->transpose(nr, dims, a->d + i0, n, at);
+        for (j0 = 0; j0 < m; j0 += bs) {
+            matrix_size_t mb = m - j0 < bs ? m - j0 : bs;
+            matrix_op_cdist_block(kernels, b, j0, mb, at, nr, nb, na + i0, metric, tile, mb);
+            for (i = 0; i < nr; i++) {
+                MATRIX_TYPE * hd = dist->d + (i0 + i) * k, * col = tile + i * mb;
+                matrix_size_t * hi = ids->i + (i0 + i) * k;
+                for (j = 0; j < mb; j++) {
+                    if (j0 + j < k) { // still filling the heap
+                        for (l = j0 + j; l > 0 && hd[(l - 1) / 2] < col[j]; l = (l - 1) / 2) {
+                            hd[l] = hd[(l - 1) / 2];
+                            hi[l] = hi[(l - 1) / 2];
+                        }
+                        hd[l] = col[j];
+                        hi[l] = j0 + j;
+                    } else if (col[j] < hd[0]) {
+                        hd[0] = col[j];
+                        hi[0] = j0 + j;
+                        matrix_heap_sift(hd, hi, k);
+                    }
+                }
+            }
+        }
+    }
+    // sorting every heap in place (increasing distances), then transposing to n*k
+    for (i = 0; i < n; i++) {
+        MATRIX_TYPE * hd = dist->d + i * k;
+        matrix_size_t * hi = ids->i + i * k;
+        for (l = k - 1; l > 0; l--) {
+            MATRIX_TYPE t = hd[0];
+            matrix_size_t id = hi[0];
+            hd[0] = hd[l];
+            hi[0] = hi[l];
+            hd[l] = t;
+            hi[l] = id;
+            matrix_heap_sift(hd, hi, l);
+        }
+    }
+    struct Matrix * out = push_matrix(L, n, k);
+    kernels->transpose(k, n, dist->d, k, out->d);
+    lua_replace(L, -3); // out, ids
+    return 2;
+}
+#endif
+#endif
+
+#ifdef MATRIX_ENABLE_QUANTIZE
+/**
+ * q = m:quantize{axis=1, symmetric=true}
+ * q.rows, q.cols, q.axis, q.symmetric, q:dequantize()
+ * y = q:dot(x, bias), y = q:tdot(x, bias)
+ *
+ * int8 copies of weight matrices, taking a quarter of the memory of float ones. Every row
+ * (axis=1) or column (axis=2) has its own scale s and zero point z, element (i, j) being about
+ * s*(q[i, j] - z): symmetric quantization maps [-max|v|, max|v|] onto [-127, 127] with z = 0, the
+ * asymmetric one maps [min, max] instead. The quantized rows (or columns) are stored one after
+ * the other, so axis=1 matrices are meant for q:dot(x) (a row per output, as in y = W·x) and axis=2
+ * ones for q:tdot(x). The columns of x are quantized on the fly (symmetrically, with scale t), the
+ * products are done in integer arithmetic by the dot_i8 kernel, by blocks of MATRIX_QUANTIZE_BLOCK
+ * bytes of weights that stay in cache while they are multiplied by every column, and the result
+ * is dequantized with the bias added on output: y[i, c] = s_i*t_c*(q_i·p_c - z_i*sum(p_c)) + bias[i].
+ */
+#define MATRIX_QUANT_MT CAT_MATRIX_STR(MATRIX_TYPE) " quantized"
+
+struct MatrixQuant {
+    matrix_size_t rows, cols;
+    matrix_size_t n, len;   // number and length of the quantized vectors (rows or columns)
+    int axis, symmetric;
+    MATRIX_TYPE * scale;    // n scales
+    int32_t * zero;         // n zero points
+    int8_t * q;             // n*len values
+    MATRIX_TYPE storage[];
+};
+
+static struct MatrixQuant * push_quant(lua_State * L, matrix_size_t rows, matrix_size_t cols, int axis, int symmetric) {
+    matrix_size_t n = axis == 1 ? rows : cols;
+    matrix_size_t size = matrix_checksize(L, rows, cols);
+    struct MatrixQuant * q = (struct MatrixQuant *)lua_newuserdata(L, sizeof (struct MatrixQuant) +
+            sizeof (MATRIX_TYPE[n]) + sizeof (int32_t[n]) + (size_t)size);
+    q->rows = rows;
+    q->cols = cols;
+    q->n = n;
+    q->len = axis == 1 ? cols : rows;
+    q->axis = axis;
+    q->symmetric = symmetric;
+    q->scale = q->storage;
+    q->zero = (int32_t *)(q->scale + n);
+    q->q = (int8_t *)(q->zero + n);
+    luaL_setmetatable(L, MATRIX_QUANT_MT);
+    return q;
+}
+
+/**
+ * quantizes n values of src (stride elements apart) into dest, returning the scale. The range
+ * always includes 0, which keeps the zero point within [-127, 127].
+ */
+static MATRIX_TYPE matrix_quantize_vector(matrix_size_t n, const MATRIX_TYPE * src, matrix_size_t stride,
+        int symmetric, int8_t * dest, int32_t * zero) {
+    MATRIX_TYPE lo = 0, hi = 0, s;
+    matrix_size_t i;
+    int32_t z = 0;
+    for (i = 0; i < n; i++) {
+        MATRIX_TYPE v = src[i * stride];
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+    }
+    if (symmetric) {
+        s = (hi > -lo ? hi : -lo) / 127;
+    } else {
+        s = (hi - lo) / 254;
+        if (s > 0) z = (int32_t)floor(-127 - lo / s + 0.5);
+    }
+    if (!(s > 0)) s = 1; // null vector
+    for (i = 0; i < n; i++) {
+        MATRIX_TYPE v = src[i * stride] / s + z;
+        dest[i] = v >= 127 ? 127 : v > -127 ? (int8_t)floor(v + 0.5) : -127;
+    }
+    *zero = z;
+    return s;
+}
+
+static int matrix_mt_quantize(lua_State * L) {
+    struct Matrix * m = (struct Matrix *)luaL_checkudata(L, 1, MATRIX_MT);
+    int axis = 1, symmetric = 1;
+    matrix_size_t k;
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "axis");
+        axis = (int)luaL_optinteger(L, -1, 1);
+        lua_getfield(L, 2, "symmetric");
+        if (!lua_isnil(L, -1)) symmetric = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+        if (axis != 1 && axis != 2) return luaL_error(L, "invalid quantization axis %d", axis);
+    }
+    struct MatrixQuant * q = push_quant(L, m->rows, m->cols, axis, symmetric);
+    for (k = 0; k < q->n; k++) {
+        if (axis == 1) q->scale[k] = matrix_quantize_vector(q->len, m->d + k, m->rows, symmetric, q->q + k * q->len, q->zero + k);
+        else q->scale[k] = matrix_quantize_vector(q->len, m->d + k * m->rows, 1, symmetric, q->q + k * q->len, q->zero + k);
+    }
+    return 1;
+}
+
+static int matrix_quant__index(lua_State * L) {
+    struct MatrixQuant * q = (struct MatrixQuant *)luaL_checkudata(L, 1, MATRIX_QUANT_MT);
+    const char * key = luaL_checkstring(L, 2);
+    if (!strcmp(key, "rows")) lua_pushinteger(L, q->rows);
+    else if (!strcmp(key, "cols")) lua_pushinteger(L, q->cols);
+    else if (!strcmp(key, "axis")) lua_pushinteger(L, q->axis);
+    else if (!strcmp(key, "symmetric")) lua_pushboolean(L, q->symmetric);
+    else {
+        luaL_getmetatable(L, MATRIX_QUANT_MT);
+        lua_getfield(L, -1, key);
+    }
+    return 1;
+}
+
+// m = q:dequantize(), the approximation of the original matrix
+static int matrix_quant_dequantize(lua_State * L) {
+    struct MatrixQuant * q = (struct MatrixQuant *)luaL_checkudata(L, 1, MATRIX_QUANT_MT);
+    struct Matrix * m = push_matrix(L, q->rows, q->cols);
+    matrix_size_t k, l;
+    for (k = 0; k < q->n; k++) {
+        const int8_t * v = q->q + k * q->len;
+        for (l = 0; l < q->len; l++) {
+            MATRIX_TYPE value = q->scale[k] * (v[l] - q->zero[k]);
+            if (q->axis == 1) m->d[l * m->rows + k] = value;
+            else m->d[k * m->rows + l] = value;
+        }
+    }
+    return 1;
+}
+
+// y = q:dot(x, bias) (axis 1) or q:tdot(x, bias) (axis 2), both being the product of the vectors by x
+static int matrix_quant_product(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    struct MatrixQuant * q = (struct MatrixQuant *)luaL_checkudata(L, 1, MATRIX_QUANT_MT);
+    struct Matrix * x = (struct Matrix *)luaL_checkudata(L, 2, MATRIX_MT);
+    struct Matrix * bias = lua_isnoneornil(L, 3) ? NULL : (struct Matrix *)luaL_checkudata(L, 3, MATRIX_MT);
+    int axis = (int)(intptr_t)lua_touserdata(L, lua_upvalueindex(1));
+    matrix_size_t c, k, n = q->n, len = q->len;
+    if (q->axis != axis)
+        return luaL_error(L, "%s needs a matrix quantized with axis=%d", axis == 1 ? "dot" : "tdot", axis);
+    if (len != x->rows)
+        return luaL_error(L, "non-conformant quantized product " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " by " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(axis == 1 ? n : len), matrix_size_arg(axis == 1 ? len : n), matrix_size_arg(x->rows), matrix_size_arg(x->cols));
+    if (bias && bias->rows * bias->cols != n)
+        return luaL_error(L, "bias of " MATRIX_SIZE_FMT " elements for " MATRIX_SIZE_FMT " outputs", matrix_size_arg(bias->rows * bias->cols), matrix_size_arg(n));
+    lua_settop(L, 3);
+    // every column of x quantized up front: sums, scales and int8 values
+    matrix_size_t b = x->cols, r0, rb = len > 0 && MATRIX_QUANTIZE_BLOCK / len > 1 ? MATRIX_QUANTIZE_BLOCK / len : 1;
+    int64_t * psum = (int64_t *)lua_newuserdata(L, sizeof (int64_t[b]) + sizeof (MATRIX_TYPE[b]) + (size_t)(len * b));
+    MATRIX_TYPE * t = (MATRIX_TYPE *)(psum + b);
+    int8_t * p = (int8_t *)(t + b);
+    struct Matrix * y = push_matrix(L, n, b);
+    for (c = 0; c < b; c++) {
+        int32_t zero;
+        t[c] = matrix_quantize_vector(len, x->d + c * len, 1, 1, p + c * len, &zero);
+        for (psum[c] = 0, k = 0; k < len; k++) psum[c] += p[c * len + k];
+    }
+    // blocks of rb weight vectors, read from memory once and kept in cache for all the columns
+#ifdef _OPENMP
+#pragma omp parallel for private(c, k) if (n * len * b >= MATRIX_QUANTIZE_PARALLEL_MIN)
+#endif
+    for (r0 = 0; r0 < n; r0 += rb) {
+        matrix_size_t rn = r0 + rb < n ? r0 + rb : n;
+        for (c = 0; c < b; c++) {
+            MATRIX_TYPE * out = y->d + c * n;
+            for (k = r0; k < rn; k++) {
+                int64_t acc = kernels->dot_i8(len, q->q + k * len, p + c * len) - q->zero[k] * psum[c];
+                out[k] = q->scale[k] * t[c] * (MATRIX_TYPE)acc + (bias ? bias->d[k] : 0);
+            }
+        }
+    }
+    lua_remove(L, -2); // scratch
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_ASYNC
+/**
+ * r = m:dot_async(p), lu = m:lup_async(tolerance), inv = m:inv_async(tolerance)
+ *
+ * The kernel runs on a process wide pool of MATRIX_ASYNC_THREADS worker threads (one per online
+ * processor when 0), started with the first job and stopped once no lua_State uses them; jobs
+ * beyond the workers wait in a queue, in order. Inside a coroutine the call yields the job object
+ * and returns the result once the coroutine is resumed after the job is done (resuming it
+ * earlier just yields the job again). Elsewhere the job is returned, see job:wait().
+ * Every finished job writes a byte into a per lua_State pipe, whose reading end is returned by
+ * matrix.async_fd(), so that event loops can wait on it and then call matrix.async_poll().
+ *
+ * Operands and results are referenced from the job's user value, and the job itself from the
+ * registry until its result is taken or it gets polled, so nothing is collected while in use.
+ */
+#define MATRIX_JOB_MT CAT_MATRIX_STR(MATRIX_TYPE) " job"
+#define MATRIX_ASYNC_KEY CAT_MATRIX_STR(MATRIX_TYPE) " async"
+#define MATRIX_PENDING_KEY CAT_MATRIX_STR(MATRIX_TYPE) " pending jobs"
+
+enum { MATRIX_JOB_DOT, MATRIX_JOB_LUP, MATRIX_JOB_INV };
+// slots of the job's user value:
+enum { MATRIX_JOB_A = 1, MATRIX_JOB_B, MATRIX_JOB_RESULT, MATRIX_JOB_THREAD };
+
+struct MatrixNotifier {
+    pthread_mutex_t lock;
+    int refs;
+    int fds[2]; // pipe, written by the workers once per finished job
+};
+
+struct MatrixJob {
+    int kind;
+    struct Matrix * a, * b, * out;
+    matrix_size_t * p;                // lup permutation
+    int compact;            // lup P as an index
+    MATRIX_TYPE tolerance;
+    int result;             // lup swaps or -1
+    int queued;
+    atomic_int done;
+    struct MatrixJob * next; // in the queue
+    struct MatrixNotifier * notifier;
+};
+
+// the worker pool, shared by every lua_State: lock guards the queue and the threads, life is held
+// while counting users and stopping the workers
+static struct {
+    pthread_mutex_t lock, life;
+    pthread_cond_t work, finished; // a job was queued, a job is done
+    struct MatrixJob * head, * tail;
+    pthread_t * threads;
+    int size, count, stop;
+    int users; // notifiers, under life
+} matrix_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void matrix_job_run(struct MatrixJob * job);
+
+static void * matrix_pool_worker(void * arg) {
+    (void)arg;
+    pthread_mutex_lock(&matrix_pool.lock);
+    for (;;) {
+        struct MatrixJob * job = matrix_pool.head;
+        if (!job) {
+            if (matrix_pool.stop) break;
+            pthread_cond_wait(&matrix_pool.work, &matrix_pool.lock);
+            continue;
+        }
+        matrix_pool.head = job->next;
+        if (!matrix_pool.head) matrix_pool.tail = NULL;
+        pthread_mutex_unlock(&matrix_pool.lock);
+        matrix_job_run(job);
+        pthread_mutex_lock(&matrix_pool.lock);
+        // under the lock, so that the job (and its notifier) are not released before this is over:
+        atomic_store(&job->done, 1);
+        if (write(job->notifier->fds[1], "", 1) < 0) {
+            // full pipe: it is readable anyway, async_poll checks every pending job
+        }
+        pthread_cond_broadcast(&matrix_pool.finished);
+    }
+    pthread_mutex_unlock(&matrix_pool.lock);
+    return NULL;
+}
+
+// queues a job, starting another worker while there are less than the pool size, 0 on failure
+static int matrix_pool_submit(struct MatrixJob * job) {
+    int ok = 1;
+    pthread_mutex_lock(&matrix_pool.lock);
+    if (!matrix_pool.threads) {
+        matrix_pool.size = MATRIX_ASYNC_THREADS;
+        if (matrix_pool.size < 1) matrix_pool.size = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (matrix_pool.size < 1) matrix_pool.size = 1;
+        matrix_pool.threads = malloc(sizeof (pthread_t) * matrix_pool.size);
+    }
+    if (matrix_pool.threads && matrix_pool.count < matrix_pool.size
+            && !pthread_create(&matrix_pool.threads[matrix_pool.count], NULL, &matrix_pool_worker, NULL))
+        matrix_pool.count++;
+    if (matrix_pool.count) {
+        job->next = NULL;
+        if (matrix_pool.tail) matrix_pool.tail->next = job; else matrix_pool.head = job;
+        matrix_pool.tail = job;
+        job->queued = 1;
+        pthread_cond_signal(&matrix_pool.work);
+    } else ok = 0;
+    pthread_mutex_unlock(&matrix_pool.lock);
+    return ok;
+}
+
+static void matrix_pool_acquire(void) {
+    pthread_mutex_lock(&matrix_pool.life);
+    matrix_pool.users++;
+    pthread_mutex_unlock(&matrix_pool.life);
+}
+
+// the last user stops the workers, every job being finished by then (jobs keep their notifier)
+static void matrix_pool_release(void) {
+    int i;
+    pthread_mutex_lock(&matrix_pool.life);
+    if (--matrix_pool.users == 0 && matrix_pool.threads) {
+        pthread_mutex_lock(&matrix_pool.lock);
+        matrix_pool.stop = 1;
+        pthread_cond_broadcast(&matrix_pool.work);
+        pthread_mutex_unlock(&matrix_pool.lock);
+        for (i = 0; i < matrix_pool.count; i++) pthread_join(matrix_pool.threads[i], NULL);
+        free(matrix_pool.threads);
+        matrix_pool.threads = NULL;
+        matrix_pool.count = matrix_pool.stop = 0;
+    }
+    pthread_mutex_unlock(&matrix_pool.life);
+}
+
+static void matrix_notifier_release(struct MatrixNotifier * n) {
+    pthread_mutex_lock(&n->lock);
+    int refs = --n->refs;
+    pthread_mutex_unlock(&n->lock);
+    if (refs) return;
+    matrix_pool_release();
+    close(n->fds[0]);
+    close(n->fds[1]);
+    pthread_mutex_destroy(&n->lock);
+    free(n);
+}
+
+static int matrix_notifier_gc(lua_State * L) {
+    struct MatrixNotifier ** n = (struct MatrixNotifier **)lua_touserdata(L, 1);
+    if (*n) matrix_notifier_release(*n);
+    *n = NULL;
+    return 0;
+}
+
+// returns the lua_State's notifier, creating it on first use
+static struct MatrixNotifier * matrix_notifier(lua_State * L) {
+    struct MatrixNotifier ** ud;
+    if (lua_getfield(L, LUA_REGISTRYINDEX, MATRIX_ASYNC_KEY) != LUA_TNIL) {
+        ud = (struct MatrixNotifier **)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return *ud;
+    }
+    lua_pop(L, 1);
+    ud = (struct MatrixNotifier **)lua_newuserdata(L, sizeof (struct MatrixNotifier *));
+    *ud = NULL;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, &matrix_notifier_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    struct MatrixNotifier * n = malloc(sizeof (struct MatrixNotifier));
+    if (!n || pipe(n->fds)) {
+        free(n);
+        luaL_error(L, "cannot create the async notification pipe");
+    }
+    fcntl(n->fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(n->fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(n->fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(n->fds[1], F_SETFD, FD_CLOEXEC);
+    pthread_mutex_init(&n->lock, NULL);
+    n->refs = 1;
+    matrix_pool_acquire();
+    *ud = n;
+    lua_setfield(L, LUA_REGISTRYINDEX, MATRIX_ASYNC_KEY);
+    return n;
+}
+
+static void matrix_job_run(struct MatrixJob * job) {
+    switch (job->kind) {
+#ifdef MATRIX_ENABLE_DOT
+        case MATRIX_JOB_DOT:
+            matrix_op_gemm(job->a->rows, job->b->cols, job->a->cols, 1, job->a->d, job->a->rows,
+                    job->b->d, job->b->rows, 0, job->out->d, job->out->rows);
+            break;
+#endif
+#ifdef MATRIX_ENABLE_LUP
+        case MATRIX_JOB_LUP:
+            job->result = matrix_op_lup(job->out, job->p, job->tolerance);
+            break;
+#endif
+#ifdef MATRIX_ENABLE_INV
+        case MATRIX_JOB_INV:
+            matrix_op_rref(job->b, job->out, job->tolerance);
+            break;
+#endif
+    }
+}
+
+// blocks until a queued job is done, and its worker is through with it
+static void matrix_job_join(struct MatrixJob * job) {
+    if (!job->queued) return;
+    pthread_mutex_lock(&matrix_pool.lock);
+    while (!atomic_load(&job->done)) pthread_cond_wait(&matrix_pool.finished, &matrix_pool.lock);
+    pthread_mutex_unlock(&matrix_pool.lock);
+    job->queued = 0;
+}
+
+static int matrix_job_gc(lua_State * L) {
+    struct MatrixJob * job = (struct MatrixJob *)luaL_checkudata(L, 1, MATRIX_JOB_MT);
+    matrix_job_join(job);
+    free(job->p);
+    job->p = NULL;
+    if (job->notifier) matrix_notifier_release(job->notifier);
+    job->notifier = NULL;
+    return 0;
+}
+
+/**
+ * pushes a new job and its user value table {a, b}, leaving the job at the top
+ * of the stack and the table right below it
+ */
+static struct MatrixJob * push_job(lua_State * L, int kind, int a, int b) {
+    a = lua_absindex(L, a);
+    b = lua_absindex(L, b);
+    lua_createtable(L, 4, 0);
+    lua_pushvalue(L, a);
+    lua_rawseti(L, -2, MATRIX_JOB_A);
+    lua_pushvalue(L, b);
+    lua_rawseti(L, -2, MATRIX_JOB_B);
+    struct MatrixJob * job = (struct MatrixJob *)lua_newuserdata(L, sizeof (struct MatrixJob));
+    memset(job, 0, sizeof (struct MatrixJob));
+    atomic_init(&job->done, 0);
+    job->kind = kind;
+    luaL_setmetatable(L, MATRIX_JOB_MT);
+    lua_pushvalue(L, -2);
+    lua_setuservalue(L, -2);
+    return job;
+}
+
+// pushes the results of a finished job, returning how many
+static int matrix_job_result(lua_State * L, int idx) {
+    struct MatrixJob * job = (struct MatrixJob *)luaL_checkudata(L, idx, MATRIX_JOB_MT);
+    matrix_job_join(job);
+    // no longer pending:
+    lua_getfield(L, LUA_REGISTRYINDEX, MATRIX_PENDING_KEY);
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    lua_getuservalue(L, idx);
+    lua_rawgeti(L, -1, MATRIX_JOB_RESULT);
+#ifdef MATRIX_ENABLE_LUP
+    if (job->kind == MATRIX_JOB_LUP) {
+        if (job->result < 0) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "degenerate matrix");
+            return 2;
+        }
+        if (job->p) { // first time: complete the table
+            matrix_lup_finish(L, job->out, job->p, job->result, job->compact);
+            free(job->p);
+            job->p = NULL;
+        }
+    }
+#endif
+    return 1;
+}
+
+static int matrix_async_continue(lua_State * L, int status, lua_KContext ctx) {
+    int idx = (int)ctx;
+    struct MatrixJob * job = (struct MatrixJob *)lua_touserdata(L, idx);
+    (void)status; // always LUA_YIELD, resumed after matrix_async_start's yield
+    lua_settop(L, idx);
+    if (!atomic_load(&job->done)) {
+        lua_pushvalue(L, idx);
+        return lua_yieldk(L, 1, ctx, &matrix_async_continue);
+    }
+    return matrix_job_result(L, idx);
+}
+
+/**
+ * starts the job at the top of the stack (its user value table right below) and either yields
+ * it or returns it to the caller
+ */
+static int matrix_async_start(lua_State * L, struct MatrixJob * job) {
+    int idx = lua_gettop(L);
+    struct MatrixNotifier * n = matrix_notifier(L);
+    // pending jobs, also reachable from async_poll:
+    if (lua_getfield(L, LUA_REGISTRYINDEX, MATRIX_PENDING_KEY) == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, MATRIX_PENDING_KEY);
+    }
+    if (lua_isyieldable(L)) {
+        lua_pushthread(L);
+        lua_rawseti(L, idx - 1, MATRIX_JOB_THREAD);
+    }
+    pthread_mutex_lock(&n->lock);
+    n->refs++;
+    pthread_mutex_unlock(&n->lock);
+    job->notifier = n;
+    if (!matrix_pool_submit(job)) return luaL_error(L, "cannot start a worker thread");
+    lua_pushvalue(L, idx);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_settop(L, idx);
+    if (!lua_isyieldable(L)) return 1;
+    lua_pushvalue(L, idx);
+    return lua_yieldk(L, 1, idx, &matrix_async_continue);
+}
+
+#ifdef MATRIX_ENABLE_DOT
+static int matrix_mt_dot_async(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    struct Matrix * p = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
+    if (m->cols != p->rows)
+        return luaL_error(L, "non-conformant matrix multiplication " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " by " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(m->rows), matrix_size_arg(m->cols), matrix_size_arg(p->rows), matrix_size_arg(p->cols));
+    lua_settop(L, 2);
+    // the job reads copies, so that m and p can still be written meanwhile:
+    push_matrix_cow(L, 1, m->rows, m->cols, 0);
+    lua_replace(L, 1);
+    push_matrix_cow(L, 2, p->rows, p->cols, 0);
+    lua_replace(L, 2);
+    struct MatrixJob * job = push_job(L, MATRIX_JOB_DOT, 1, 2);
+    job->a = (struct Matrix*)lua_touserdata(L, 1);
+    job->b = (struct Matrix*)lua_touserdata(L, 2);
+    job->out = push_matrix(L, m->rows, p->cols);
+    lua_rawseti(L, -3, MATRIX_JOB_RESULT);
+    return matrix_async_start(L, job);
+}
+#endif
+
+#ifdef MATRIX_ENABLE_LUP
+static int matrix_mt_lup_async(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    MATRIX_TYPE tolerance = luaL_optnumber(L, 2, 1e-38);
+    int compact = lua_toboolean(L, 3);
+    matrix_size_t n = m->rows;
+    if (n != m->cols) return luaL_error(L, "square matrix required");
+    lua_settop(L, 1);
+    struct MatrixJob * job = push_job(L, MATRIX_JOB_LUP, 1, 1);
+    job->tolerance = tolerance;
+    job->compact = compact;
+    job->p = malloc(sizeof (matrix_size_t) * n);
+    if (!job->p) return luaL_error(L, "not enough memory");
+    lua_createtable(L, 0, 4);
+    job->out = push_matrix(L, n, n);
+    memcpy(job->out->d, m->d, sizeof (MATRIX_TYPE[n*n]));
+    lua_setfield(L, -2, "U");
+    lua_rawseti(L, -3, MATRIX_JOB_RESULT);
+    return matrix_async_start(L, job);
+}
+#endif
+
+#ifdef MATRIX_ENABLE_INV
+static int matrix_mt_inv_async(lua_State * L) {
+    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
+    MATRIX_TYPE tolerance = luaL_optnumber(L, 2, 1e-38);
+    if (m->rows != m->cols) return luaL_error(L, "square matrix required");
+    lua_settop(L, 1);
+    struct Matrix * mcopy = push_matrix(L, m->rows, m->cols);
+    memcpy(mcopy->d, m->d, sizeof (MATRIX_TYPE[m->rows * m->cols]));
+    struct MatrixJob * job = push_job(L, MATRIX_JOB_INV, 1, 2);
+    lua_remove(L, 2); // mcopy, now in the user value
+    job->tolerance = tolerance;
+    job->b = mcopy;
+    job->out = push_id_matrix(L, m->rows);
+    lua_rawseti(L, -3, MATRIX_JOB_RESULT);
+    return matrix_async_start(L, job);
+}
+#endif
+
+// job:done() returns true once the result is available
+static int matrix_job_done(lua_State * L) {
+    struct MatrixJob * job = (struct MatrixJob *)luaL_checkudata(L, 1, MATRIX_JOB_MT);
+    lua_pushboolean(L, atomic_load(&job->done));
+    return 1;
+}
+
+// job:wait() blocks until the job is done and returns its result
+static int matrix_job_wait(lua_State * L) {
+    lua_settop(L, 1);
+    return matrix_job_result(L, 1);
+}
+
+// job:coroutine() returns the coroutine that yielded waiting for the job (or nil)
+static int matrix_job_coroutine(lua_State * L) {
+    luaL_checkudata(L, 1, MATRIX_JOB_MT);
+    lua_getuservalue(L, 1);
+    lua_rawgeti(L, -1, MATRIX_JOB_THREAD);
+    return 1;
+}
+
+// fd = matrix.async_fd(), readable whenever some job finished since the last async_poll()
+static int matrix_async_fd(lua_State * L) {
+    lua_pushinteger(L, matrix_notifier(L)->fds[0]);
+    return 1;
+}
+
+// jobs = matrix.async_poll(), list of the jobs finished since the last call
+static int matrix_async_poll(lua_State * L) {
+    char buf[64];
+    int n = 0;
+    while (read(matrix_notifier(L)->fds[0], buf, sizeof buf) > 0);
+    lua_newtable(L);
+    if (lua_getfield(L, LUA_REGISTRYINDEX, MATRIX_PENDING_KEY) == LUA_TNIL) return 1;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        struct MatrixJob * job = (struct MatrixJob *)lua_touserdata(L, -2);
+        lua_pop(L, 1);
+        if (atomic_load(&job->done)) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -4, ++n);
+        }
+    }
+    // no longer pending (not done while traversing, lua_next forbids new keys but not clearing them)
+    for (; n > 0; n--) {
+        lua_rawgeti(L, -2, n);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+#endif
+
+#ifdef MATRIX_ENABLE_TILED
+/**
+ * t = matrix.tiled(path, h, w, {tile=n, cache=c}) or matrix.tiled(path, m, opts)
+ * t = matrix.open_tiled(path, readonly, {cache=c})
+ * t.rows, t.cols, t.tile, t[{rows, cols}], t[slice] = m or value, t:sync()
+ * r = t:dot(p, path), t:tdot(p, path), t:t(path), t + p, t - p, t * p, t / p, t:sum()
+ *
+ * Matrices bigger than memory, kept in a file as square tile*tile blocks (column major and zero
+ * padded at the borders) after a page sized header, the tiles themselves in column major order.
+ * The file is mapped as a whole and every operation goes through it a tile at a time, handing
+ * dense blocks to the same kernels as in memory matrices. Residency is managed here instead of by
+ * the kernel's read-ahead (the mapping is MADV_RANDOM): every tiled matrix remembers its last
+ * `cache` tiles, dropping older ones from memory, and the loops announce the next tiles
+ * (MADV_WILLNEED) while computing with the current ones. Results are new tiled matrices, stored
+ * in path or in an already unlinked file in $TMPDIR.
+ */
+#define MATRIX_TILED_MT CAT_MATRIX_STR(MATRIX_TYPE) " tiled"
+#define MATRIX_TILED_MAGIC "lmtiled1"
+#define MATRIX_TILED_HEADER 4096 // bytes before the first tile, keeping tiles page aligned
+
+struct MatrixTiledHeader {
+    char magic[8];
+    int64_t rows, cols, tile, elsize;
+};
+
+struct MatrixTiled {
+    matrix_size_t rows, cols, tile;
+    matrix_size_t tr, tc;       // number of tiles along each dimension
+    int fd, readonly;
+    unsigned char * map;        // the whole file
+    size_t size;
+    int cache, used;            // capacity and number of resident tiles
+    matrix_size_t lru[];        // resident tiles, the most recently used one last
+};
+
+#define matrix_tiled_bytes(t) sizeof (MATRIX_TYPE[(t)->tile * (t)->tile])
+// rows or columns of the tile at position i along a dimension of n elements
+#define matrix_tiled_extent(t, i, n) ((n) - (i) * (t)->tile < (t)->tile ? (n) - (i) * (t)->tile : (t)->tile)
+
+// madvise for the pages of tile k, also dropping them from the page cache on MADV_DONTNEED
+static void matrix_tiled_advise(struct MatrixTiled * t, matrix_size_t k, int advice) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = MATRIX_TILED_HEADER + (size_t)k * matrix_tiled_bytes(t);
+    size_t end = (start + matrix_tiled_bytes(t) + page - 1) / page * page;
+    start = start / page * page;
+    if (end > t->size) end = t->size;
+    madvise(t->map + start, end - start, advice);
+    if (advice == MADV_DONTNEED) posix_fadvise(t->fd, start, end - start, POSIX_FADV_DONTNEED);
+}
+
+// announces that tile (i, j) is needed soon, ignoring positions out of t
+static void matrix_tiled_prefetch(struct MatrixTiled * t, matrix_size_t i, matrix_size_t j) {
+    if (i < t->tr && j < t->tc) matrix_tiled_advise(t, j * t->tr + i, MADV_WILLNEED);
+}
+
+// tile (i, j) of t, which becomes the most recently used one
+static MATRIX_TYPE * matrix_tiled_tile(struct MatrixTiled * t, matrix_size_t i, matrix_size_t j) {
+    matrix_size_t k = j * t->tr + i;
+    int l;
+    for (l = t->used - 1; l >= 0 && t->lru[l] != k; l--);
+    if (l < 0) { // not resident, making room if needed
+        if (t->used == t->cache) {
+            matrix_tiled_advise(t, t->lru[0], MADV_DONTNEED);
+            l = 0;
+        } else {
+            l = t->used++;
+        }
+    }
+    memmove(t->lru + l, t->lru + l + 1, sizeof (matrix_size_t[t->used - 1 - l]));
+    t->lru[t->used - 1] = k;
+    return (MATRIX_TYPE *)(t->map + MATRIX_TILED_HEADER + (size_t)k * matrix_tiled_bytes(t));
+}
+
+static int matrix_tiled_gc(lua_State * L) {
+    struct MatrixTiled * t = (struct MatrixTiled *)luaL_checkudata(L, 1, MATRIX_TILED_MT);
+    if (t->map) munmap(t->map, t->size);
+    if (t->fd >= 0) close(t->fd);
+    t->map = NULL;
+    t->fd = -1;
+    return 0;
+}
+
+// pushes an unmapped tiled matrix with room for cache resident tiles, to be set up by the caller
+static struct MatrixTiled * push_tiled(lua_State * L, int cache) {
+    if (cache < 1) luaL_error(L, "invalid tiled cache size %d", cache);
+    struct MatrixTiled * t = (struct MatrixTiled *)lua_newuserdata(L, sizeof (struct MatrixTiled) + sizeof (matrix_size_t[cache]));
+    memset(t, 0, sizeof (struct MatrixTiled));
+    t->fd = -1;
+    t->cache = cache;
+    luaL_setmetatable(L, MATRIX_TILED_MT);
+    return t;
+}
+
+// computes the tile grid and file size of t from its rows, cols and tile
+static void matrix_tiled_setsize(lua_State * L, struct MatrixTiled * t) {
+    t->tr = (t->rows + t->tile - 1) / t->tile;
+    t->tc = (t->cols + t->tile - 1) / t->tile;
+    if ((PTRDIFF_MAX - MATRIX_TILED_HEADER) / matrix_tiled_bytes(t) < (size_t)matrix_checksize(L, t->tr, t->tc))
+        luaL_error(L, "invalid size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT ", too big", matrix_size_arg(t->rows), matrix_size_arg(t->cols));
+    t->size = MATRIX_TILED_HEADER + (size_t)(t->tr * t->tc) * matrix_tiled_bytes(t);
+}
+
+static void matrix_tiled_map(lua_State * L, struct MatrixTiled * t, const char * path) {
+    t->map = mmap(NULL, t->size, PROT_READ | (t->readonly ? 0 : PROT_WRITE), MAP_SHARED, t->fd, 0);
+    if (t->map == MAP_FAILED) {
+        t->map = NULL;
+        luaL_error(L, "cannot map %s: %s", path, strerror(errno));
+    }
+    madvise(t->map, t->size, MADV_RANDOM);
+}
+
+/**
+ * pushes a new rows*cols tiled matrix, filled with zeros, stored in path or in a temporary file
+ * if it is NULL
+ */
+static struct MatrixTiled * push_tiled_new(lua_State * L, const char * path, matrix_size_t rows, matrix_size_t cols,
+        matrix_size_t tile, int cache) {
+    if (rows < 1 || cols < 1 || tile < 1 || tile > MATRIX_MAX_ELEMENTS / tile)
+        luaL_error(L, "invalid tiled size " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " with " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " tiles",
+                matrix_size_arg(rows), matrix_size_arg(cols), matrix_size_arg(tile), matrix_size_arg(tile));
+    struct MatrixTiled * t = push_tiled(L, cache);
+    t->rows = rows;
+    t->cols = cols;
+    t->tile = tile;
+    matrix_tiled_setsize(L, t);
+    if (path) {
+        t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    } else {
+        const char * dir = getenv("TMPDIR");
+        if (!dir || !*dir) dir = "/tmp";
+        char * name = (char *)lua_newuserdata(L, strlen(dir) + sizeof "/matrix-tiled-XXXXXX");
+        strcpy(name, dir);
+        strcat(name, "/matrix-tiled-XXXXXX");
+        t->fd = mkstemp(name);
+        if (t->fd >= 0) unlink(name);
+        lua_pop(L, 1);
+        path = "a temporary file";
+    }
+    if (t->fd < 0) luaL_error(L, "cannot create %s: %s", path, strerror(errno));
+    struct MatrixTiledHeader h = {MATRIX_TILED_MAGIC, rows, cols, tile, sizeof (MATRIX_TYPE)};
+    if (ftruncate(t->fd, t->size) || pwrite(t->fd, &h, sizeof h, 0) != (ssize_t)sizeof h)
+        luaL_error(L, "cannot write %s: %s", path, strerror(errno));
+    matrix_tiled_map(L, t, path);
+    return t;
+}
+
+// opts.key as a positive integer, def if opts is not a table or has no such key
+static matrix_size_t matrix_tiled_opt(lua_State * L, int opts, const char * key, matrix_size_t def) {
+    if (!lua_istable(L, opts)) return def;
+    lua_getfield(L, opts, key);
+    def = luaL_optinteger(L, -1, def);
+    lua_pop(L, 1);
+    return def;
+}
+
+/**
+ * copies between the 0 based block [row1, rown]*[col1, coln] of t and d (with ld rows), towards
+ * t if write is set. When d is NULL the block is filled with value instead.
+ */
+static void matrix_tiled_block(struct MatrixTiled * t, matrix_size_t row1, matrix_size_t rown, matrix_size_t col1,
+        matrix_size_t coln, MATRIX_TYPE * d, matrix_size_t ld, int write, MATRIX_TYPE value) {
+    matrix_size_t i, j, c, r, n = t->tile;
+    for (j = col1 / n; j <= coln / n; j++) {
+        for (i = row1 / n; i <= rown / n; i++) {
+            MATRIX_TYPE * tile = matrix_tiled_tile(t, i, j);
+            if (i < rown / n) matrix_tiled_prefetch(t, i + 1, j); else matrix_tiled_prefetch(t, row1 / n, j + 1);
+            matrix_size_t r0 = row1 > i * n ? row1 : i * n, r1 = rown < i * n + n - 1 ? rown : i * n + n - 1;
+            matrix_size_t c0 = col1 > j * n ? col1 : j * n, c1 = coln < j * n + n - 1 ? coln : j * n + n - 1;
+            for (c = c0; c <= c1; c++) {
+                MATRIX_TYPE * tc = tile + (c - j * n) * n + (r0 - i * n);
+                if (!d) {
+                    for (r = 0; r <= r1 - r0; r++) tc[r] = value;
+                } else {
+                    MATRIX_TYPE * dc = d + (c - col1) * ld + (r0 - row1);
+                    if (write) memcpy(tc, dc, sizeof (MATRIX_TYPE[r1 - r0 + 1]));
+                    else memcpy(dc, tc, sizeof (MATRIX_TYPE[r1 - r0 + 1]));
+                }
+            }
+        }
+    }
 }
-#endif
 
-#if defined(MATRIX_TYPE_FLOAT)
-#  define MATRIX_ABS_OP(x) fabsf(x)
-#elif defined(MATRIX_TYPE_DOUBLE)
-#  define MATRIX_ABS_OP(x) fabs(x)
-#else
-#  define MATRIX_ABS_OP(x) ((x)<0 ? -(x) : (x))
-#endif
+static struct MatrixTiled * matrix_checktiled_writable(lua_State * L, int idx) {
+    struct MatrixTiled * t = (struct MatrixTiled *)luaL_checkudata(L, idx, MATRIX_TILED_MT);
+    if (t->readonly) luaL_error(L, "read-only matrix");
+    return t;
+}
 
-#ifdef MATRIX_ENABLE_RESHAPE
-static int matrix_mt_reshape(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    int rows = luaL_checkinteger(L, 2);
-    int cols = luaL_checkinteger(L, 3);
-    if (rows < 1 || cols < 1 || rows*cols != m->rows*m->cols)
-        return luaL_error(L, "invalid reshape size %d*%d", rows, cols);
-    m->rows = rows;
-    m->cols = cols;
-    return 0;
+static int matrix_tiled(lua_State * L) {
+    const char * path = luaL_optstring(L, 1, NULL);
+    struct Matrix * m = (struct Matrix *)luaL_testudata(L, 2, MATRIX_MT);
+    matrix_size_t rows = m ? m->rows : luaL_checkinteger(L, 2);
+    matrix_size_t cols = m ? m->cols : luaL_checkinteger(L, 3);
+    int opts = m ? 3 : 4;
+    struct MatrixTiled * t = push_tiled_new(L, path, rows, cols, matrix_tiled_opt(L, opts, "tile", MATRIX_TILED_TILE),
+            (int)matrix_tiled_opt(L, opts, "cache", MATRIX_TILED_CACHE));
+    if (m) matrix_tiled_block(t, 0, rows - 1, 0, cols - 1, m->d, rows, 1, 0);
+    return 1;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_T
-static int matrix_mt_t(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    struct Matrix * dest = push_matrix(L, m->cols, m->rows);
-    int i, j;
-    int m_cursor = 0;
-    for (j = 0; j < m->cols; j++) {
-        int dest_cursor = j;
-        for (i = 0; i < m->rows; i++, dest_cursor += m->cols)
-            dest->d[dest_cursor] = m->d[m_cursor++];
-    }
+static int matrix_open_tiled(lua_State * L) {
+    const char * path = luaL_checkstring(L, 1);
+    int readonly = lua_toboolean(L, 2);
+    struct MatrixTiled * t = push_tiled(L, (int)matrix_tiled_opt(L, 3, "cache", MATRIX_TILED_CACHE));
+    struct MatrixTiledHeader h;
+    struct stat st;
+    t->readonly = readonly;
+    t->fd = open(path, (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (t->fd < 0) return luaL_error(L, "cannot open %s: %s", path, strerror(errno));
+    if (pread(t->fd, &h, sizeof h, 0) != (ssize_t)sizeof h || memcmp(h.magic, MATRIX_TILED_MAGIC, sizeof h.magic))
+        return luaL_error(L, "%s is not a tiled matrix", path);
+    if (h.elsize != sizeof (MATRIX_TYPE))
+        return luaL_error(L, "%s has %d byte elements, expecting " CAT_MATRIX_STR(MATRIX_TYPE) " ones", path, (int)h.elsize);
+    if (h.rows < 1 || h.cols < 1 || h.tile < 1 || h.tile > MATRIX_MAX_ELEMENTS / h.tile)
+        return luaL_error(L, "%s has an invalid geometry", path);
+    t->rows = h.rows;
+    t->cols = h.cols;
+    t->tile = h.tile;
+    matrix_tiled_setsize(L, t);
+    if (fstat(t->fd, &st) || (size_t)st.st_size < t->size) return luaL_error(L, "%s is truncated", path);
+    matrix_tiled_map(L, t, path);
     return 1;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_DOT
-static int matrix_mt_dot(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    struct Matrix * p = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
-    if (m->cols != p->rows)
-        return luaL_error(L, "non-conformant matrix multiplication %d*%d by %d*%d", m->rows, m->cols, p->rows, p->cols);
-    struct Matrix * dest = push_matrix(L, m->rows, p->cols);
-    int i, j;
-    for (j = 0; j < dest->cols; j++) {
-        for (i = 0; i < dest->rows; i++) {
-            MATRIX_TYPE res = 0;
-            int m_cursor = i;
-            int p_cursor = j * p->rows;
-            int p_limit = p_cursor + p->rows;
-            for (; p_cursor < p_limit; p_cursor++, m_cursor += m->rows)
-                res += m->d[m_cursor] * p->d[p_cursor];
-            dest->d[i + j * dest->rows] = res;
-        }
-    }
+// t:sync() writes the modified tiles back to the file
+static int matrix_tiled_sync(lua_State * L) {
+    struct MatrixTiled * t = (struct MatrixTiled *)luaL_checkudata(L, 1, MATRIX_TILED_MT);
+    if (msync(t->map, t->size, MS_SYNC)) return luaL_error(L, "cannot sync a tiled matrix: %s", strerror(errno));
+    lua_settop(L, 1);
     return 1;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_TDOT
-static int matrix_mt_tdot(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    struct Matrix * p = (struct Matrix*)luaL_checkudata(L, 2, MATRIX_MT);
-    if (m->rows != p->rows)
-        return luaL_error(L, "non-conformant operands for tdot %d*%d by %d*%d", m->rows, m->cols, p->rows, p->cols);
-    struct Matrix * dest = push_matrix(L, m->cols, p->cols);
-    int i, j;
-    for (j = 0; j < dest->cols; j++) {
-        for (i = 0; i < dest->rows; i++) {
-            MATRIX_TYPE res = 0;
-            int m_cursor = i * m->rows;
-            int p_cursor = j * p->rows;
-            int p_limit = p_cursor + p->rows;
-            for (; p_cursor < p_limit; p_cursor++, m_cursor++)
-                res += m->d[m_cursor] * p->d[p_cursor];
-            dest->d[i + j * dest->rows] = res;
+static int matrix_tiled__index(lua_State * L) {
+    struct MatrixTiled * t = (struct MatrixTiled *)luaL_checkudata(L, 1, MATRIX_TILED_MT);
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        const char * key = lua_tostring(L, 2);
+        if (!strcmp(key, "rows")) lua_pushinteger(L, t->rows);
+        else if (!strcmp(key, "cols")) lua_pushinteger(L, t->cols);
+        else if (!strcmp(key, "tile")) lua_pushinteger(L, t->tile);
+        else if (!strcmp(key, "readonly")) lua_pushboolean(L, t->readonly);
+        else {
+            luaL_getmetatable(L, MATRIX_TILED_MT);
+            lua_getfield(L, -1, key);
         }
+        return 1;
     }
+    matrix_size_t row1, rown, col1, coln;
+    if (lua_isnumber(L, 2)) {
+        matrix_size_t idx = luaL_checkinteger(L, 2);
+        if (idx < 1 || idx > t->rows * t->cols) return luaL_error(L, "index out of bounds: " MATRIX_SIZE_FMT, matrix_size_arg(idx));
+        row1 = rown = (idx - 1) % t->rows + 1;
+        col1 = coln = (idx - 1) / t->rows + 1;
+    } else if (lua_istable(L, 2) || lua_isuserdata(L, 2)) {
+        if (matrix_checkslice(L, 2, t->rows, t->cols, &row1, &rown, &col1, &coln) < 2) {
+            struct Matrix * dest = push_matrix(L, rown - row1 + 1, coln - col1 + 1);
+            matrix_tiled_block(t, row1 - 1, rown - 1, col1 - 1, coln - 1, dest->d, dest->rows, 0, 0);
+            return 1;
+        }
+    } else return luaL_error(L, "invalid index type");
+    MATRIX_TYPE value;
+    matrix_tiled_block(t, row1 - 1, row1 - 1, col1 - 1, col1 - 1, &value, 1, 0, 0);
+    lua_pushnumber(L, value);
     return 1;
 }
-#endif
 
-#if defined(MATRIX_ENABLE_RSWAP) || defined(MATRIX_ENABLE_LUP)
-static void matrix_op_rswap(struct Matrix * m, int r1, int r2) {
-    int limit = m->rows * m->cols;
-    for (; r1 < limit; r1 += m->rows, r2 += m->rows) {
-        MATRIX_TYPE t = m->d[r1];
-        m->d[r1] = m->d[r2];
-        m->d[r2] = t;
+static int matrix_tiled__newindex(lua_State * L) {
+    struct MatrixTiled * t = matrix_checktiled_writable(L, 1);
+    matrix_size_t row1, rown, col1, coln;
+    if (lua_isnumber(L, 2)) {
+        matrix_size_t idx = luaL_checkinteger(L, 2);
+        if (idx < 1 || idx > t->rows * t->cols) return luaL_error(L, "index out of bounds: " MATRIX_SIZE_FMT, matrix_size_arg(idx));
+        row1 = rown = (idx - 1) % t->rows + 1;
+        col1 = coln = (idx - 1) / t->rows + 1;
+    } else if (lua_istable(L, 2) || lua_isuserdata(L, 2)) {
+        matrix_checkslice(L, 2, t->rows, t->cols, &row1, &rown, &col1, &coln);
+    } else return luaL_error(L, "invalid index type");
+    if (lua_isnumber(L, 3)) {
+        matrix_tiled_block(t, row1 - 1, rown - 1, col1 - 1, coln - 1, NULL, 0, 1, lua_tonumber(L, 3));
+    } else {
+        struct Matrix * src = (struct Matrix*)luaL_checkudata(L, 3, MATRIX_MT);
+        if (src->rows != rown - row1 + 1 || src->cols != coln - col1 + 1)
+            return luaL_error(L, "non-conforming source " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " matrix, expecting " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT,
+                    matrix_size_arg(src->rows), matrix_size_arg(src->cols), matrix_size_arg(rown - row1 + 1), matrix_size_arg(coln - col1 + 1));
+        matrix_tiled_block(t, row1 - 1, rown - 1, col1 - 1, coln - 1, src->d, src->rows, 1, 0);
     }
+    return 0;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_RSWAP
-static int matrix_mt_rswap(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    int r1 = luaL_checkinteger(L, 2);
-    int r2 = luaL_checkinteger(L, 3);
-    if (r1 < 1 || r2 < 1 || r1 > m->rows || r2 > m->rows)
-        return luaL_error(L, "invalid row indices for rswap: %d, %d", r1, r2);
-    if (r1 == r2) return 0;
-    matrix_op_rswap(m, r1, r2);
-    return 0;
+// checks the tiled operands at 1 and 2, which must have the same tile size
+static struct MatrixTiled * matrix_tiled_operands(lua_State * L, struct MatrixTiled ** b) {
+    struct MatrixTiled * a = (struct MatrixTiled *)luaL_checkudata(L, 1, MATRIX_TILED_MT);
+    *b = (struct MatrixTiled *)luaL_checkudata(L, 2, MATRIX_TILED_MT);
+    if (a->tile != (*b)->tile)
+        luaL_error(L, "tiled operands with different tiles " MATRIX_SIZE_FMT " and " MATRIX_SIZE_FMT, matrix_size_arg(a->tile), matrix_size_arg((*b)->tile));
+    return a;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_CSWAP
-static void matrix_cswap(struct Matrix * m, int c1, int c2) {
-    int cursor1 = c1 * m->rows, cursor2 = c2 * m->rows;
-    int i;
-    for (i = m->rows; i >= 0; i--, cursor1++, cursor2++) {
-        MATRIX_TYPE t = m->d[cursor1];
-        m->d[cursor1] = m->d[cursor2];
-        m->d[cursor2] = t;
+/**
+ * c = a*b (or transpose(a)*b when tn is set), by blocks of pi*pj tiles of c that stay resident
+ * while the whole depth goes by: for each l the pi tiles of a are used once each and the pj tiles
+ * of b are kept for the pi rows, so a is read c->tc/pj times and b c->tr/pi times. The block is
+ * about square and sized by the cache of c, then narrowed until the pj tiles of b (and the current
+ * tile of a, when both are the same matrix sharing one cache) fit in the cache of b.
+ */
+static void matrix_op_tiled_gemm(struct MatrixTiled * a, struct MatrixTiled * b, struct MatrixTiled * c, int tn) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    matrix_size_t n = a->tile, depth = tn ? a->tr : a->tc, i0, j0, i, j, l;
+    matrix_size_t pi, pj = 1, room = b->cache - 1 - (a == b);
+    while ((pj + 1) * (pj + 1) <= c->cache) pj++;
+    if (pj > room) pj = room;
+    if (pj > c->tc) pj = c->tc;
+    if (pj < 1) pj = 1;
+    pi = c->cache / pj;
+    if (pi > c->tr) pi = c->tr;
+    if (pi < 1) pi = 1;
+    for (j0 = 0; j0 < c->tc; j0 += pj) {
+        matrix_size_t nj = c->tc - j0 < pj ? c->tc - j0 : pj;
+        for (i0 = 0; i0 < c->tr; i0 += pi) {
+            matrix_size_t ni = c->tr - i0 < pi ? c->tr - i0 : pi;
+            for (l = 0; l < depth; l++) {
+                for (i = i0; i < i0 + ni; i++) {
+                    MATRIX_TYPE * at = tn ? matrix_tiled_tile(a, l, i) : matrix_tiled_tile(a, i, l);
+                    if (i + 1 < i0 + ni) {
+                        if (tn) matrix_tiled_prefetch(a, l, i + 1); else matrix_tiled_prefetch(a, i + 1, l);
+                    } else if (l + 1 < depth) {
+                        if (tn) matrix_tiled_prefetch(a, l + 1, i0); else matrix_tiled_prefetch(a, i0, l + 1);
+                    }
+                    for (j = j0; j < j0 + nj; j++) {
+                        MATRIX_TYPE * bt = matrix_tiled_tile(b, l, j);
+                        MATRIX_TYPE * ct = matrix_tiled_tile(c, i, j);
+                        if (i == i0 && l + 1 < depth) matrix_tiled_prefetch(b, l + 1, j);
+                        if (tn) kernels->gemm_tn(n, n, n, 1, at, n, bt, n, l ? 1 : 0, ct, n);
+                        else kernels->gemm(n, n, n, 1, at, n, bt, n, l ? 1 : 0, ct, n);
+                    }
+                }
+            }
+        }
     }
 }
 
-static int matrix_mt_cswap(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    int c1 = luaL_checkinteger(L, 2);
-    int c2 = luaL_checkinteger(L, 3);
-    if (c1 < 1 || c2 < 1 || c1 > m->cols || c2 > m->cols)
-        return luaL_error(L, "invalid column indices for cswap: %d, %d", c1, c2);
-    if (c1 == c2) return 0;
-    matrix_cswap(m, c1, c2);
-    return 0;
+// r = t:dot(p, path)
+static int matrix_tiled_dot(lua_State * L) {
+    struct MatrixTiled * b, * a = matrix_tiled_operands(L, &b);
+    if (a->cols != b->rows)
+        return luaL_error(L, "non-conformant matrix multiplication " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " by " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(a->rows), matrix_size_arg(a->cols), matrix_size_arg(b->rows), matrix_size_arg(b->cols));
+    struct MatrixTiled * c = push_tiled_new(L, luaL_optstring(L, 3, NULL), a->rows, b->cols, a->tile, a->cache);
+    matrix_op_tiled_gemm(a, b, c, 0);
+    return 1;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_LUP
-static int matrix_mt_lup(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    MATRIX_TYPE tolerance = luaL_optnumber(L, 2, 1e-38);
-    int i, j, k, swaps = 0, n = m->rows;
-    int size = n*n;
-    if (n != m->cols) return luaL_error(L, "square matrix required");
-    int *p = malloc(sizeof (int) * n);
-    for (i = 0; i < n; i++) p[i] = i;
-    lua_createtable(L, 0, 4); //{L=..., U=..., p=ptable, swaps=integer}
-    // u starts as a copy of m:
-    struct Matrix * upper = push_matrix(L, n, n);
-    memcpy(upper->d, m->d, sizeof (MATRIX_TYPE[n*n]));
-    lua_setfield(L, -2, "U");
-    int i_as_column_offset = 0;
-    for (i = 0; i < n; i++, i_as_column_offset += n) {
-        int maxi = i;
-        MATRIX_TYPE maxabs = MATRIX_ABS_OP(upper->d[i_as_column_offset + i]);
-        for (k = i + 1; k < n; k++) {
-            MATRIX_TYPE abs_k = MATRIX_ABS_OP(upper->d[i_as_column_offset + k]);
-            if (abs_k > maxabs) {
-                maxabs = abs_k;
-                maxi = k;
-            }
-        }
-        if (maxabs < tolerance) {
-            free(p);
-            lua_pushnil(L);
-            lua_pushliteral(L, "degenerate matrix");
-            return 2;
-        }
-        if (i != maxi) {
-            int t = p[i];
-            p[i] = p[maxi];
-            p[maxi] = t;
-            matrix_op_rswap(upper, i, maxi);
-            swaps++;
-        }
-        for (j = i + 1; j < n; j++) {
-            MATRIX_TYPE pivot = (upper->d[j + i_as_column_offset] /= upper->d[i + i_as_column_offset]);
-            for (k = i_as_column_offset + n; k < size; k += n) {
-                upper->d[j + k] -= pivot * upper->d[i + k];
-            }
-        }
-    }
+// r = t:tdot(p, path) == t:t():dot(p)
+static int matrix_tiled_tdot(lua_State * L) {
+    struct MatrixTiled * b, * a = matrix_tiled_operands(L, &b);
+    if (a->rows != b->rows)
+        return luaL_error(L, "non-conformant operands for tdot " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT " by " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(a->rows), matrix_size_arg(a->cols), matrix_size_arg(b->rows), matrix_size_arg(b->cols));
+    struct MatrixTiled * c = push_tiled_new(L, luaL_optstring(L, 3, NULL), a->cols, b->cols, a->tile, a->cache);
+    matrix_op_tiled_gemm(a, b, c, 1);
+    return 1;
+}
 
-    struct Matrix * lower = push_matrix(L, n, n);
-    // build L as copy of U's lower part, setting zeros in U's lower triangle, L's upper triangle
-    //       and ones into L's diagonal
-    for (i = 0, i_as_column_offset = 0; i < n; i++, i_as_column_offset += n) {
-        for (j = 0; j < i; j++) { // upper triangle
-            lower->d[i_as_column_offset + j] = 0;
-        }
-        lower->d[i_as_column_offset + i] = 1; // diagonal
-        for (j = i + 1; j < n; j++) { // lower triangle
-            lower->d[i_as_column_offset + j] = upper->d[i_as_column_offset + j];
-            upper->d[i_as_column_offset + j] = 0;
+// r = t:t(path), transposing whole tiles (padding ends up as padding)
+static int matrix_tiled_t(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    struct MatrixTiled * a = (struct MatrixTiled *)luaL_checkudata(L, 1, MATRIX_TILED_MT);
+    struct MatrixTiled * c = push_tiled_new(L, luaL_optstring(L, 2, NULL), a->cols, a->rows, a->tile, a->cache);
+    matrix_size_t i, j;
+    for (j = 0; j < a->tc; j++) {
+        for (i = 0; i < a->tr; i++) {
+            MATRIX_TYPE * src = matrix_tiled_tile(a, i, j);
+            if (i + 1 < a->tr) matrix_tiled_prefetch(a, i + 1, j); else matrix_tiled_prefetch(a, 0, j + 1);
+            kernels->transpose(a->tile, a->tile, src, a->tile, matrix_tiled_tile(c, j, i));
         }
     }
-    lua_setfield(L, -2, "L");
-    // setting p table as copy of p:
-    lua_createtable(L, n, 0);
-    for (i = 0; i < n; i++) {
-        lua_pushinteger(L, p[i] + 1);
-        lua_rawseti(L, -2, i+1);
-    }
-    lua_setfield(L, -2, "p");
-    struct Matrix * perm = push_matrix(L, n, n);
-    // and P matrix as the permutation matrix corresponding to p:
-    for (i = 0; i < size; i++) perm->d[i] = 0;
-    for (i = 0; i < n; i++) perm->d[i + p[i]*n] = 1;
-    lua_setfield(L, -2, "P");
-    // setting swaps into returned table:
-    lua_pushinteger(L, swaps);
-    lua_setfield(L, -2, "swaps");
-    // return determinant as well:
-    MATRIX_TYPE det = swaps&1 ? -1 : 1;
-    for (i = 0; i < size; i += n + 1) det *= upper->d[i];
-    lua_pushnumber(L, det);
-    lua_setfield(L, -2, "det");
-    free(p);
     return 1;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_RREF
-static int matrix_mt_rref(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    MATRIX_TYPE tolerance = luaL_optnumber(L, 2, 1e-38);
-    MATRIX_TYPE pivot;
-    int i, j, k, i_as_column_offset, w = m->cols, h = m->rows;
-    int size = w*h;
-    struct Matrix * inv = w==h ? push_id_matrix(L, w) : NULL;
-    struct Matrix * mcopy = push_matrix(L, h, w);
-    for (i = 0; i < size; i++) mcopy->d[i] = m->d[i];
-    for (i = 0, i_as_column_offset = 0; i < h && i_as_column_offset < size; i_as_column_offset += h) {
-        int maxi = i;
-        MATRIX_TYPE maxabs = MATRIX_ABS_OP(mcopy->d[i_as_column_offset + i]);
-        for (k = i + 1; k < h; k++) {
-            MATRIX_TYPE abs_k = MATRIX_ABS_OP(mcopy->d[i_as_column_offset + k]);
-            if (abs_k > maxabs) {
-                maxabs = abs_k;
-                maxi = k;
-            }
-        }
-        if (maxabs < tolerance) continue;
-        if (i != maxi) {
-            matrix_op_rswap(mcopy, i, maxi);
-            if (inv) matrix_op_rswap(inv, i, maxi);
-        }
-        // normalize ith-row
-        pivot = mcopy->d[i_as_column_offset + i];
-        mcopy->d[i_as_column_offset + i] = 1;
-        for (k = i_as_column_offset + h; k < size; k += h) mcopy->d[k + i] /= pivot;
-        if (inv) {
-            for (k = i; k < size; k += h) inv->d[k] /= pivot;
-        }
-        // normalize remaining rows:
-        for (j = 0; j < h; j++) {
-            if (j == i) continue;
-            pivot = mcopy->d[j + i_as_column_offset];
-            if (pivot == 0) continue;
-            for (k = i_as_column_offset + h; k < size; k += h) mcopy->d[j+k] -= pivot * mcopy->d[i+k];
-            if (inv) {
-                for (k = 0; k < size; k += h) inv->d[j+k] -= pivot * inv->d[i+k];
+/**
+ * t + p, t - p, t * p, t / p (elementwise), where either side can be a number and tiled operands
+ * must be of the same size. Only the elements inside the matrix are computed, leaving the padding
+ * at zero.
+ */
+static int matrix_tiled_binop(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    int op = (int)(intptr_t)lua_touserdata(L, lua_upvalueindex(1));
+    struct MatrixTiled * a = (struct MatrixTiled *)luaL_testudata(L, 1, MATRIX_TILED_MT);
+    struct MatrixTiled * b = (struct MatrixTiled *)luaL_testudata(L, 2, MATRIX_TILED_MT);
+    struct MatrixTiled * shape = a ? a : b;
+    MATRIX_TYPE s = 0;
+    if (!a || !b) {
+        if (!shape || !lua_isnumber(L, a ? 2 : 1)) return luaL_error(L, "invalid operands for a tiled matrix operation");
+        s = lua_tonumber(L, a ? 2 : 1);
+    } else if (a->rows != b->rows || a->cols != b->cols || a->tile != b->tile) {
+        return luaL_error(L, "non conformat tiled matrices " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT ", " MATRIX_SIZE_FMT "*" MATRIX_SIZE_FMT, matrix_size_arg(a->rows), matrix_size_arg(a->cols), matrix_size_arg(b->rows), matrix_size_arg(b->cols));
+    }
+    struct MatrixTiled * c = push_tiled_new(L, NULL, shape->rows, shape->cols, shape->tile, shape->cache);
+    matrix_size_t n = shape->tile, i, j, k;
+    for (j = 0; j < c->tc; j++) {
+        matrix_size_t w = matrix_tiled_extent(c, j, c->cols);
+        for (i = 0; i < c->tr; i++) {
+            matrix_size_t h = matrix_tiled_extent(c, i, c->rows);
+            MATRIX_TYPE * at = a ? matrix_tiled_tile(a, i, j) : NULL, * bt = b ? matrix_tiled_tile(b, i, j) : NULL;
+            MATRIX_TYPE * ct = matrix_tiled_tile(c, i, j);
+            matrix_size_t ni = i + 1 < c->tr ? i + 1 : 0, nj = i + 1 < c->tr ? j : j + 1;
+            if (a) matrix_tiled_prefetch(a, ni, nj);
+            if (b) matrix_tiled_prefetch(b, ni, nj);
+            for (k = 0; k < w; k++) {
+                if (a && b) kernels->vv[op](h, at + k * n, bt + k * n, ct + k * n);
+                else if (a) kernels->vs[op](h, at + k * n, s, ct + k * n);
+                else kernels->sv[op](h, s, bt + k * n, ct + k * n);
             }
-            mcopy->d[j + i_as_column_offset] = 0;
         }
-        i++;
-    }
-    if (inv) {
-        lua_insert(L, -2); // swapped to return rref, inv
-        return 2;
     }
     return 1;
 }
-#endif
 
-#ifdef MATRIX_ENABLE_INV
-static int matrix_mt_inv(lua_State * L) {
-    struct Matrix * m = (struct Matrix*)luaL_checkudata(L, 1, MATRIX_MT);
-    if (m->rows != m->cols) return luaL_error(L, "square matrix required");
-    return matrix_mt_rref(L) - 1;
+// t:sum(), accumulated in a lua_Number across columns
+static int matrix_tiled_sum(lua_State * L) {
+    const struct MatrixKernels * kernels = matrix_kernels;
+    struct MatrixTiled * t = (struct MatrixTiled *)luaL_checkudata(L, 1, MATRIX_TILED_MT);
+    matrix_size_t i, j, k;
+    lua_Number res = 0;
+    for (j = 0; j < t->tc; j++) {
+        matrix_size_t w = matrix_tiled_extent(t, j, t->cols);
+        for (i = 0; i < t->tr; i++) {
+            matrix_size_t h = matrix_tiled_extent(t, i, t->rows);
+            MATRIX_TYPE * tile = matrix_tiled_tile(t, i, j);
+            if (i + 1 < t->tr) matrix_tiled_prefetch(t, i + 1, j); else matrix_tiled_prefetch(t, 0, j + 1);
+            for (k = 0; k < w; k++) res += kernels->sum(h, tile + k * t->tile);
+        }
+    }
+    lua_pushnumber(L, res);
+    return 1;
 }
 #endif
 
@@ -757,8 +3736,22 @@ LUALIB_API void matrix_luaL_setfuncs_ud (lua_State *L, const struct matrix_luaL_
 #else
 #  error "unary op only supported for float and double"
 #endif
+#define matrix_op_map_declare(name, map) { name, matrix_op_map, (void *)(intptr_t)(map) },
 
 EXPORT_C int luaopen_matrix(lua_State * L) {
+    if (!matrix_kernels) {
+        const struct MatrixKernels * best = NULL;
+        int i;
+        for (i = 0; matrix_kernel_tiers[i]; i++)
+            if (matrix_cpu_supports(matrix_kernel_tiers[i])) best = matrix_kernel_tiers[i];
+#ifdef MATRIX_ATOMICS
+        // unless another state has just done it (and maybe switched them with matrix.cpu)
+        const struct MatrixKernels * none = NULL;
+        atomic_compare_exchange_strong(&matrix_kernels_current, &none, best);
+#else
+        matrix_kernels_set(best);
+#endif
+    }
     if (luaL_newmetatable(L, MATRIX_MT)) {
         luaL_getmetatable(L, MATRIX_MT);
         lua_pushinteger(L, -1);
@@ -768,6 +3761,12 @@ EXPORT_C int luaopen_matrix(lua_State * L) {
         matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
             {"__index", &matrix_mt__index},
             {"__newindex", &matrix_mt__newindex},
+#if defined(MATRIX_ENABLE_SHARE) || defined(MATRIX_ENABLE_COW)
+            {"__gc", &matrix_mt__gc},
+#endif
+#ifdef MATRIX_ENABLE_SHARE
+            {"share", &matrix_mt_share},
+#endif
 #ifdef MATRIX_ENABLE__TOSTRING
             {"__tostring", &matrix_mt__tostring},
 #endif
@@ -801,6 +3800,22 @@ EXPORT_C int luaopen_matrix(lua_State * L) {
 #ifdef MATRIX_ENABLE_T
             {"t", &matrix_mt_t},
 #endif
+#ifdef MATRIX_ENABLE_SUM
+            {"sum", &matrix_mt_sum},
+#endif
+#ifdef MATRIX_ENABLE_WINDOW
+            {"window", &matrix_mt_window},
+#endif
+#ifdef MATRIX_ENABLE_INDEX
+            {"take_rows", &matrix_mt_take_rows},
+            {"take_cols", &matrix_mt_take_cols},
+            {"scatter_rows_", &matrix_mt_scatter_rows_},
+#endif
+#ifdef MATRIX_ENABLE_MASK
+            {"masked_fill_", &matrix_mt_masked_fill_},
+            {"count", &matrix_mt_count},
+            {"compress", &matrix_mt_compress},
+#endif
 #ifdef MATRIX_ENABLE_DOT
             {"dot", &matrix_mt_dot},
 #endif
@@ -821,15 +3836,43 @@ EXPORT_C int luaopen_matrix(lua_State * L) {
 #endif
 #ifdef MATRIX_ENABLE_INV
             {"inv", &matrix_mt_inv},
+#endif
+#ifdef MATRIX_ENABLE_QR
+            {"qr", &matrix_mt_qr},
+#endif
+#ifdef MATRIX_ENABLE_LSTSQ
+            {"lstsq", &matrix_mt_lstsq},
+#endif
+#ifdef MATRIX_ENABLE_CONV2D
+            {"conv2d", &matrix_mt_conv2d},
+#endif
+#ifdef MATRIX_ENABLE_QUANTIZE
+            {"quantize", &matrix_mt_quantize},
+#endif
+#if defined(MATRIX_ENABLE_ASYNC) && defined(MATRIX_ENABLE_DOT)
+            {"dot_async", &matrix_mt_dot_async},
+#endif
+#if defined(MATRIX_ENABLE_ASYNC) && defined(MATRIX_ENABLE_LUP)
+            {"lup_async", &matrix_mt_lup_async},
+#endif
+#if defined(MATRIX_ENABLE_ASYNC) && defined(MATRIX_ENABLE_INV)
+            {"inv_async", &matrix_mt_inv_async},
 #endif
             {NULL, NULL}
         });
         matrix_luaL_setfuncs_ud(L, (struct matrix_luaL_RegUd[]){
+#ifdef MATRIX_ENABLE_MASK
+            { "lt", matrix_op_cmp, (void *)(intptr_t)MATRIX_LT },
+            { "le", matrix_op_cmp, (void *)(intptr_t)MATRIX_LE },
+            { "gt", matrix_op_cmp, (void *)(intptr_t)MATRIX_GT },
+            { "ge", matrix_op_cmp, (void *)(intptr_t)MATRIX_GE },
+            { "eq", matrix_op_cmp, (void *)(intptr_t)MATRIX_EQ },
+#endif
 #ifdef MATRIX_ENABLE_FLOOR
-            matrix_op_unary_declare("floor", floorf, floor)
+            matrix_op_map_declare("floor", MATRIX_FLOOR)
 #endif
 #ifdef MATRIX_ENABLE_CEIL
-            matrix_op_unary_declare("ceil", ceilf, ceil)
+            matrix_op_map_declare("ceil", MATRIX_CEIL)
 #endif
 #ifdef MATRIX_ENABLE_ACOS
             matrix_op_unary_declare("acos", acosf, acos)
@@ -871,7 +3914,7 @@ EXPORT_C int luaopen_matrix(lua_State * L) {
             matrix_op_unary_declare("sqrt", sqrtf, sqrt)
 #endif
 #ifdef MATRIX_ENABLE_ABS
-            matrix_op_unary_declare("abs", fabsf, fabs)
+            matrix_op_map_declare("abs", MATRIX_ABS)
 #endif
 #ifdef MATRIX_ENABLE_ISINF
             matrix_op_unary_declare("isinf", isinff, isinf)
@@ -882,10 +3925,110 @@ EXPORT_C int luaopen_matrix(lua_State * L) {
 #ifdef MATRIX_ENABLE_ISNAN
             matrix_op_unary_declare("isnan", isnanf, isnan)
 #endif
-            {NULL, NULL}
+            {NULL, NULL, NULL}
         });
     }
     lua_pop(L, 1); // discard metatable
+#ifdef MATRIX_ENABLE_MASK
+    if (luaL_newmetatable(L, MATRIX_MASK_MT)) {
+        matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
+            {"__index", &matrix_mask__index},
+            {"__band",  &matrix_mask__band},
+            {"__bor",   &matrix_mask__bor},
+            {"__bxor",  &matrix_mask__bxor},
+            {"__bnot",  &matrix_mask__bnot},
+            {"count",   &matrix_mt_count},
+            {NULL,      NULL}
+        });
+    }
+    lua_pop(L, 1);
+#endif
+#ifdef MATRIX_ENABLE_INDEX
+    if (luaL_newmetatable(L, MATRIX_INDEX_MT)) {
+        matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
+            {"__index",  &matrix_index__index},
+            {"__len",    &matrix_index__len},
+            {"apply",    &matrix_index_apply},
+            {"inverse",  &matrix_index_inverse},
+            {"totable",  &matrix_index_totable},
+            {NULL,       NULL}
+        });
+    }
+    lua_pop(L, 1);
+#endif
+    luaL_newmetatable(L, MATRIX_SLICE_MT); // no methods, slices are only used as keys
+    lua_pop(L, 1);
+#ifdef MATRIX_ENABLE_RNG
+    if (luaL_newmetatable(L, MATRIX_RNG_MT)) {
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
+            {"stream",    &matrix_rng_stream},
+            {"skip",      &matrix_rng_skip},
+            {"uniform",   &matrix_rng_uniform},
+            {"normal",    &matrix_rng_normal},
+            {"bernoulli", &matrix_rng_bernoulli},
+            {"randint",   &matrix_rng_randint},
+#ifdef MATRIX_ENABLE_INDEX
+            {"perm",      &matrix_rng_perm},
+#endif
+            {NULL,        NULL}
+        });
+    }
+    lua_pop(L, 1);
+#endif
+#ifdef MATRIX_ENABLE_ASYNC
+    if (luaL_newmetatable(L, MATRIX_JOB_MT)) {
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
+            {"__gc",      &matrix_job_gc},
+            {"done",      &matrix_job_done},
+            {"wait",      &matrix_job_wait},
+            {"coroutine", &matrix_job_coroutine},
+            {NULL,        NULL}
+        });
+    }
+    lua_pop(L, 1);
+#endif
+#ifdef MATRIX_ENABLE_TILED
+    if (luaL_newmetatable(L, MATRIX_TILED_MT)) {
+        matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
+            {"__index",    &matrix_tiled__index},
+            {"__newindex", &matrix_tiled__newindex},
+            {"__gc",       &matrix_tiled_gc},
+            {"sync",       &matrix_tiled_sync},
+            {"dot",        &matrix_tiled_dot},
+            {"tdot",       &matrix_tiled_tdot},
+            {"t",          &matrix_tiled_t},
+            {"sum",        &matrix_tiled_sum},
+            {NULL,         NULL}
+        });
+        matrix_luaL_setfuncs_ud(L, (struct matrix_luaL_RegUd[]){
+            { "__add", matrix_tiled_binop, (void *)(intptr_t)MATRIX_ADD },
+            { "__sub", matrix_tiled_binop, (void *)(intptr_t)MATRIX_SUB },
+            { "__mul", matrix_tiled_binop, (void *)(intptr_t)MATRIX_MUL },
+            { "__div", matrix_tiled_binop, (void *)(intptr_t)MATRIX_DIV },
+            {NULL, NULL, NULL}
+        });
+    }
+    lua_pop(L, 1);
+#endif
+#ifdef MATRIX_ENABLE_QUANTIZE
+    if (luaL_newmetatable(L, MATRIX_QUANT_MT)) {
+        matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
+            {"__index",    &matrix_quant__index},
+            {"dequantize", &matrix_quant_dequantize},
+            {NULL,         NULL}
+        });
+        matrix_luaL_setfuncs_ud(L, (struct matrix_luaL_RegUd[]){
+            { "dot",  matrix_quant_product, (void *)(intptr_t)1 },
+            { "tdot", matrix_quant_product, (void *)(intptr_t)2 },
+            {NULL, NULL, NULL}
+        });
+    }
+    lua_pop(L, 1);
+#endif
     // main table:
     lua_newtable(L);
     matrix_luaL_setfuncs(L, (struct matrix_luaL_Reg[]){
@@ -893,6 +4036,37 @@ EXPORT_C int luaopen_matrix(lua_State * L) {
         {"id",     &matrix_id},
         {"random", &matrix_random},
         {"fromtable", &matrix_fromtable},
+        {"slice",  &matrix_slice},
+        {"cpu",    &matrix_cpu},
+#ifdef MATRIX_ENABLE_RNG
+        {"rng",    &matrix_rng},
+#endif
+#ifdef MATRIX_ENABLE_CONV2D
+        {"conv2d", &matrix_conv2d},
+#endif
+#ifdef MATRIX_ENABLE_CDIST
+        {"cdist",  &matrix_cdist},
+#endif
+#if defined(MATRIX_ENABLE_CDIST) && defined(MATRIX_ENABLE_INDEX)
+        {"topk",   &matrix_topk},
+#endif
+#ifdef MATRIX_ENABLE_MASK
+        {"where",  &matrix_where},
+#endif
+#ifdef MATRIX_ENABLE_INDEX
+        {"index",  &matrix_index},
+#endif
+#ifdef MATRIX_ENABLE_SHARE
+        {"adopt",  &matrix_adopt},
+#endif
+#ifdef MATRIX_ENABLE_TILED
+        {"tiled",      &matrix_tiled},
+        {"open_tiled", &matrix_open_tiled},
+#endif
+#ifdef MATRIX_ENABLE_ASYNC
+        {"async_fd",   &matrix_async_fd},
+        {"async_poll", &matrix_async_poll},
+#endif
         {NULL,     NULL}
     });
     return 1;
@@ -5,11 +5,23 @@
 //#define MATRIX_TYPE_DOUBLE
 #endif
 
+// sizes, indices and offsets: 64 bits on 64 bit targets, so that matrices can exceed 2^31 elements
+typedef ptrdiff_t matrix_size_t;
+
 struct Matrix {
-    int rows, cols;
-    MATRIX_TYPE d[]; // column major order
+    matrix_size_t rows, cols;
+    MATRIX_TYPE * d; // column major order, pointing to storage unless shared
+    struct MatrixShared * shared; // buffer shared between lua_States (see m:share)
+    struct Matrix * owner; // matrix whose storage d points to, if it is another one (copy on write)
+    int refs; // number of matrices using this one's storage
+    MATRIX_TYPE storage[];
 };
 
+// support for counter based random generators: r = matrix.rng(seed), r:uniform(h, w), r:normal(m)...
+#define MATRIX_ENABLE_RNG
+// fills of at least this many elements are split between threads when built with -fopenmp
+#define MATRIX_RNG_PARALLEL_MIN 65536
+
 // support for tostring(m) via __tostring metamethod
 #define MATRIX_ENABLE__TOSTRING
 
@@ -43,6 +55,20 @@ struct Matrix {
 // support for matrix transposition: m:t()
 #define MATRIX_ENABLE_T
 
+// support for the sum of all the elements: m:sum()
+#define MATRIX_ENABLE_SUM
+
+// support for sliding windows: for win, i, j in m:window(h, w, stride) do ... end
+#define MATRIX_ENABLE_WINDOW
+
+// support for comparisons returning bit packed masks: m:lt(x), m:le(x), m:gt(x), m:ge(x), m:eq(x),
+// and for using them: matrix.where(mask, a, b), m:masked_fill_(mask, v), m:count(mask), m:compress(mask)
+#define MATRIX_ENABLE_MASK
+
+// support for index vectors and permutations: p = matrix.index{...}, m:take_rows(p), m:take_cols(p),
+// m:scatter_rows_(p, src), p:apply(m), p:inverse(), r:perm(n, k), m:lup(tolerance, true)
+#define MATRIX_ENABLE_INDEX
+
 // support for matrix multiplication: m:dot(p) where sizes must be i*k and k*j
 #define MATRIX_ENABLE_DOT
 
@@ -64,6 +90,57 @@ struct Matrix {
 // support for matrix inversion (requires MATRIX_ENABLE_RREF)
 #define MATRIX_ENABLE_INV
 
+// support for zero copy sharing between lua_States of the same process (requires POSIX threads):
+// token = m:share(readonly), m2 = matrix.adopt(token)
+#define MATRIX_ENABLE_SHARE
+
+// support for blocked Householder QR factorization: qr = m:qr(), x = qr:solve(b)
+#define MATRIX_ENABLE_QR
+// number of columns per panel, trailing updates are done by blocks of that many reflectors
+#define MATRIX_QR_BLOCK 32
+
+// support for least squares solving: x = m:lstsq(b) (requires MATRIX_ENABLE_QR)
+#define MATRIX_ENABLE_LSTSQ
+
+// support for 2D convolution: m:conv2d(kernel, opts) and matrix.conv2d(channels, filters, opts)
+#define MATRIX_ENABLE_CONV2D
+// filters with at least this many taps (rows*cols*channels) go through im2col and matrix products
+#define MATRIX_CONV2D_IM2COL_MIN 32
+// maximum number of elements of the im2col patch buffer
+#define MATRIX_CONV2D_CHUNK (1 << 20)
+
+// support for distances between the rows of two matrices: d = matrix.cdist(a, b, {metric="euclidean"})
+// and nearest neighbours: dist, ids = matrix.topk(a, b, k, opts) (requires MATRIX_ENABLE_INDEX)
+#define MATRIX_ENABLE_CDIST
+// rows of each operand per block, so that the blocks of distances stay in cache
+#define MATRIX_CDIST_BLOCK 256
+
+// support for int8 quantized matrices with a scale and zero point per row or column:
+// q = m:quantize{axis=1, symmetric=true}, y = q:dot(x, bias), y = q:tdot(x, bias), q:dequantize()
+#define MATRIX_ENABLE_QUANTIZE
+// bytes of weights per block of q:dot and q:tdot, kept in cache while going through x's columns
+#define MATRIX_QUANTIZE_BLOCK (1 << 17)
+// products with at least this many multiply-adds are split between threads when built with -fopenmp
+#define MATRIX_QUANTIZE_PARALLEL_MIN (1 << 20)
+
+// support for running dot, lup and inv on a worker thread: m:dot_async(p), m:lup_async(), m:inv_async()
+// yielding the calling coroutine until done (requires POSIX threads and lua 5.3 or later)
+#define MATRIX_ENABLE_ASYNC
+// worker threads running the async jobs, shared by every lua_State (0: one per online processor)
+#define MATRIX_ASYNC_THREADS 0
+
+// copy on write: copies and slices of whole columns share their elements with the original
+// matrix until either of them is modified
+#define MATRIX_ENABLE_COW
+
+// out of core matrices stored by tiles in memory mapped files (requires POSIX mmap):
+// t = matrix.tiled(path, h, w, opts), t = matrix.open_tiled(path), t:dot(p), t:tdot(p), t:t(), t + p, t:sum()
+#define MATRIX_ENABLE_TILED
+// default side of the square tiles
+#define MATRIX_TILED_TILE 1024
+// default number of tiles of every tiled matrix kept resident, older ones are dropped from memory
+#define MATRIX_TILED_CACHE 64
+
 // some unary function, where each element is applied to the corresponding C function of the same name:
 #define MATRIX_ENABLE_FLOOR
 #define MATRIX_ENABLE_CEIL
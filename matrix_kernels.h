@@ -0,0 +1,235 @@
+/**
+ * Hot loops of matrix.c, included once per instruction set with MATRIX_ISA (the tier name, also
+ * used as suffix of every function) and MATRIX_KERNEL_ATTR (its target attribute) defined. The
+ * loops are plain C written so that the compiler can vectorize them with whatever the target
+ * provides, and each inclusion ends up in a struct MatrixKernels named matrix_kernels_<isa>. The
+ * int8 dot product is the exception: compilers don't find the pairwise multiply-add instructions
+ * on their own, so MATRIX_KERNEL_I8 may also be defined to select the intrinsics to use.
+ */
+
+#ifndef MATRIX_KERNEL
+#  define MATRIX_KERNEL__(name, isa) matrix_##name##_##isa
+#  define MATRIX_KERNEL_(name, isa) MATRIX_KERNEL__(name, isa)
+#  define MATRIX_KERNEL(name) MATRIX_KERNEL_(name, MATRIX_ISA)
+#  define MATRIX_KERNEL_STR_(isa) #isa
+#  define MATRIX_KERNEL_STR(isa) MATRIX_KERNEL_STR_(isa)
+// independent accumulators of reductions, enough to fill a 512 bit register with floats
+#  define MATRIX_KERNEL_LANES 16
+// transpose is done by square tiles of this size, so that both sides stay in cache
+#  define MATRIX_KERNEL_TILE 16
+// gemm goes through a by blocks of this many rows and columns (128 KB of floats), each one
+// staying in cache while it is used for every column of b and c
+#  define MATRIX_KERNEL_GEMM_MB 256
+#  define MATRIX_KERNEL_GEMM_KB 128
+// values of MATRIX_KERNEL_I8
+#  define MATRIX_KERNEL_I8_C 0
+#  define MATRIX_KERNEL_I8_AVX2 1
+#  define MATRIX_KERNEL_I8_AVX512 2
+#  define MATRIX_KERNEL_I8_VNNI 3
+#  define MATRIX_KERNEL_I8_NEON 4
+// int8 products are summed in 32 bits by blocks of this many, 127*127 times it stays below 2^31
+#  define MATRIX_KERNEL_I8_BLOCK 65536
+#endif
+#ifndef MATRIX_KERNEL_I8
+#  define MATRIX_KERNEL_I8 MATRIX_KERNEL_I8_C
+#endif
+
+/**
+ * c = alpha * a*b + beta * c, for column major arrays where a is m*k, b is k*n and c is m*n,
+ * each one with its own leading dimension (distance between columns). Every product is done,
+ * even by zeros, so that infinities and NaNs in a propagate as in the naive sum.
+ */
+MATRIX_KERNEL_ATTR static void MATRIX_KERNEL(gemm)(matrix_size_t m, matrix_size_t n, matrix_size_t k, MATRIX_TYPE alpha,
+        const MATRIX_TYPE * a, matrix_size_t lda, const MATRIX_TYPE * b, matrix_size_t ldb,
+        MATRIX_TYPE beta, MATRIX_TYPE * c, matrix_size_t ldc) {
+    matrix_size_t i, j, l, i0, l0;
+    for (j = 0; j < n; j++) {
+        MATRIX_TYPE * ccol = c + j * ldc;
+        if (beta == 0) {
+            for (i = 0; i < m; i++) ccol[i] = 0;
+        } else if (beta != 1) {
+            for (i = 0; i < m; i++) ccol[i] *= beta;
+        }
+    }
+    for (l0 = 0; l0 < k; l0 += MATRIX_KERNEL_GEMM_KB) {
+        matrix_size_t ln = l0 + MATRIX_KERNEL_GEMM_KB < k ? l0 + MATRIX_KERNEL_GEMM_KB : k;
+        for (i0 = 0; i0 < m; i0 += MATRIX_KERNEL_GEMM_MB) {
+            matrix_size_t in = i0 + MATRIX_KERNEL_GEMM_MB < m ? i0 + MATRIX_KERNEL_GEMM_MB : m;
+            for (j = 0; j < n; j++) {
+                const MATRIX_TYPE * bcol = b + j * ldb;
+                MATRIX_TYPE * ccol = c + j * ldc;
+                // c[i0:in,j] += (alpha*b[l,j]) * a[i0:in,l], with unit stride on the inner loop
+                for (l = l0; l < ln; l++) {
+                    const MATRIX_TYPE * acol = a + l * lda;
+                    MATRIX_TYPE t = alpha * bcol[l];
+                    for (i = i0; i < in; i++) ccol[i] += t * acol[i];
+                }
+            }
+        }
+    }
+}
+
+// a·b, summing in the same order for every tier
+MATRIX_KERNEL_ATTR static MATRIX_TYPE MATRIX_KERNEL(dot)(matrix_size_t n, const MATRIX_TYPE * a, const MATRIX_TYPE * b) {
+    MATRIX_TYPE acc[MATRIX_KERNEL_LANES] = {0}, res = 0;
+    matrix_size_t i, l;
+    for (i = 0; i + MATRIX_KERNEL_LANES <= n; i += MATRIX_KERNEL_LANES)
+        for (l = 0; l < MATRIX_KERNEL_LANES; l++) acc[l] += a[i + l] * b[i + l];
+    for (; i < n; i++) res += a[i] * b[i];
+    for (l = 0; l < MATRIX_KERNEL_LANES; l++) res += acc[l];
+    return res;
+}
+
+/**
+ * c = alpha * transpose(a)*b + beta * c, where a is k*m, b is k*n and c is m*n.
+ */
+MATRIX_KERNEL_ATTR static void MATRIX_KERNEL(gemm_tn)(matrix_size_t m, matrix_size_t n, matrix_size_t k, MATRIX_TYPE alpha,
+        const MATRIX_TYPE * a, matrix_size_t lda, const MATRIX_TYPE * b, matrix_size_t ldb,
+        MATRIX_TYPE beta, MATRIX_TYPE * c, matrix_size_t ldc) {
+    matrix_size_t i, j;
+    for (j = 0; j < n; j++, b += ldb, c += ldc) {
+        const MATRIX_TYPE * acol = a;
+        for (i = 0; i < m; i++, acol += lda) {
+            MATRIX_TYPE res = MATRIX_KERNEL(dot)(k, acol, b);
+            c[i] = alpha * res + (beta == 0 ? 0 : beta * c[i]);
+        }
+    }
+}
+
+MATRIX_KERNEL_ATTR static MATRIX_TYPE MATRIX_KERNEL(sum)(matrix_size_t n, const MATRIX_TYPE * a) {
+    MATRIX_TYPE acc[MATRIX_KERNEL_LANES] = {0}, res = 0;
+    matrix_size_t i, l;
+    for (i = 0; i + MATRIX_KERNEL_LANES <= n; i += MATRIX_KERNEL_LANES)
+        for (l = 0; l < MATRIX_KERNEL_LANES; l++) acc[l] += a[i + l];
+    for (; i < n; i++) res += a[i];
+    for (l = 0; l < MATRIX_KERNEL_LANES; l++) res += acc[l];
+    return res;
+}
+
+// dest (cols*rows) = transpose(src) (rows*cols, with lds elements between columns)
+MATRIX_KERNEL_ATTR static void MATRIX_KERNEL(transpose)(matrix_size_t rows, matrix_size_t cols, const MATRIX_TYPE * src,
+        matrix_size_t lds, MATRIX_TYPE * dest) {
+    matrix_size_t i0, j0, i, j;
+    for (i0 = 0; i0 < rows; i0 += MATRIX_KERNEL_TILE) {
+        matrix_size_t in = i0 + MATRIX_KERNEL_TILE < rows ? i0 + MATRIX_KERNEL_TILE : rows;
+        for (j0 = 0; j0 < cols; j0 += MATRIX_KERNEL_TILE) {
+            matrix_size_t jn = j0 + MATRIX_KERNEL_TILE < cols ? j0 + MATRIX_KERNEL_TILE : cols;
+            for (i = i0; i < in; i++)
+                for (j = j0; j < jn; j++) dest[i * cols + j] = src[j * lds + i];
+        }
+    }
+}
+
+matrix_declare_binop_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(add_vv), MATRIX_KERNEL(add_vs), MATRIX_KERNEL(add_sv), MATRIX_ADD_OP)
+matrix_declare_binop_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(sub_vv), MATRIX_KERNEL(sub_vs), MATRIX_KERNEL(sub_sv), MATRIX_SUB_OP)
+matrix_declare_binop_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(mul_vv), MATRIX_KERNEL(mul_vs), MATRIX_KERNEL(mul_sv), MATRIX_MUL_OP)
+matrix_declare_binop_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(div_vv), MATRIX_KERNEL(div_vs), MATRIX_KERNEL(div_sv), MATRIX_DIV_OP)
+
+matrix_declare_map_kernel(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(unm), MATRIX_UNM_OP)
+matrix_declare_map_kernel(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(abs), MATRIX_ABS_OP)
+matrix_declare_map_kernel(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(floor), MATRIX_FLOOR_OP)
+matrix_declare_map_kernel(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(ceil), MATRIX_CEIL_OP)
+
+matrix_declare_cmp_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(lt_vv), MATRIX_KERNEL(lt_vs), MATRIX_LT_OP)
+matrix_declare_cmp_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(le_vv), MATRIX_KERNEL(le_vs), MATRIX_LE_OP)
+matrix_declare_cmp_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(gt_vv), MATRIX_KERNEL(gt_vs), MATRIX_GT_OP)
+matrix_declare_cmp_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(ge_vv), MATRIX_KERNEL(ge_vs), MATRIX_GE_OP)
+matrix_declare_cmp_kernels(MATRIX_KERNEL_ATTR, MATRIX_KERNEL(eq_vv), MATRIX_KERNEL(eq_vs), MATRIX_EQ_OP)
+
+// y[i] += alpha * x[i*incx], for the direct convolution (incx being the row stride)
+MATRIX_KERNEL_ATTR static void MATRIX_KERNEL(axpy)(matrix_size_t n, MATRIX_TYPE alpha, const MATRIX_TYPE * x,
+        matrix_size_t incx, MATRIX_TYPE * y) {
+    matrix_size_t i;
+    if (incx == 1) {
+        for (i = 0; i < n; i++) y[i] += alpha * x[i];
+    } else {
+        for (i = 0; i < n; i++) y[i] += alpha * x[i * incx];
+    }
+}
+
+/**
+ * a·b for int8 vectors with elements in [-127, 127]. Without -128, |a[i]| fits an unsigned byte
+ * and |a[i]|*sign(a[i])*b[i] pairs add up in 16 bits without saturating, which is what the u8*s8
+ * instructions (pmaddubsw, vpdpbusd) need.
+ */
+MATRIX_KERNEL_ATTR static int64_t MATRIX_KERNEL(dot_i8)(matrix_size_t n, const int8_t * a, const int8_t * b) {
+    int64_t res = 0;
+    while (n > 0) {
+        matrix_size_t len = n < MATRIX_KERNEL_I8_BLOCK ? n : MATRIX_KERNEL_I8_BLOCK, i = 0;
+        int32_t acc = 0;
+#if MATRIX_KERNEL_I8 == MATRIX_KERNEL_I8_AVX2
+        __m256i v = _mm256_setzero_si256(), ones = _mm256_set1_epi16(1);
+        int32_t lanes[8];
+        int l;
+        for (; i + 32 <= len; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+            __m256i p = _mm256_maddubs_epi16(_mm256_sign_epi8(x, x), _mm256_sign_epi8(y, x));
+            v = _mm256_add_epi32(v, _mm256_madd_epi16(p, ones));
+        }
+        _mm256_storeu_si256((__m256i *)lanes, v);
+        for (l = 0; l < 8; l++) acc += lanes[l];
+#elif MATRIX_KERNEL_I8 == MATRIX_KERNEL_I8_AVX512 || MATRIX_KERNEL_I8 == MATRIX_KERNEL_I8_VNNI
+        __m512i v = _mm512_setzero_si512();
+        for (; i + 64 <= len; i += 64) {
+            __m512i x = _mm512_loadu_si512(a + i), y = _mm512_loadu_si512(b + i);
+            __m512i sy = _mm512_mask_sub_epi8(y, _mm512_movepi8_mask(x), _mm512_setzero_si512(), y);
+#  if MATRIX_KERNEL_I8 == MATRIX_KERNEL_I8_VNNI
+            v = _mm512_dpbusd_epi32(v, _mm512_abs_epi8(x), sy);
+#  else
+            v = _mm512_add_epi32(v, _mm512_madd_epi16(_mm512_maddubs_epi16(_mm512_abs_epi8(x), sy), _mm512_set1_epi16(1)));
+#  endif
+        }
+        acc += _mm512_reduce_add_epi32(v);
+#elif MATRIX_KERNEL_I8 == MATRIX_KERNEL_I8_NEON
+        int32x4_t v = vdupq_n_s32(0);
+        for (; i + 16 <= len; i += 16) {
+            int8x16_t x = vld1q_s8(a + i), y = vld1q_s8(b + i);
+            v = vpadalq_s16(v, vmull_s8(vget_low_s8(x), vget_low_s8(y)));
+            v = vpadalq_s16(v, vmull_s8(vget_high_s8(x), vget_high_s8(y)));
+        }
+        acc += vgetq_lane_s32(v, 0) + vgetq_lane_s32(v, 1) + vgetq_lane_s32(v, 2) + vgetq_lane_s32(v, 3);
+#endif
+        for (; i < len; i++) acc += a[i] * b[i];
+        res += acc;
+        a += len;
+        b += len;
+        n -= len;
+    }
+    return res;
+}
+
+// c = mask ? a : b, mask being a byte per element (0 or 1); c may be a or b
+MATRIX_KERNEL_ATTR static void MATRIX_KERNEL(select)(matrix_size_t n, const unsigned char * mask,
+        const MATRIX_TYPE * a, const MATRIX_TYPE * b, MATRIX_TYPE * c) {
+    matrix_size_t i;
+    for (i = 0; i < n; i++) c[i] = mask[i] ? a[i] : b[i];
+}
+
+// dest[k] = src[idx[k]]
+MATRIX_KERNEL_ATTR static void MATRIX_KERNEL(gather)(matrix_size_t n, const matrix_size_t * idx, const MATRIX_TYPE * src, MATRIX_TYPE * dest) {
+    matrix_size_t k;
+    for (k = 0; k < n; k++) dest[k] = src[idx[k]];
+}
+
+static const struct MatrixKernels MATRIX_KERNEL(kernels) = {
+    MATRIX_KERNEL_STR(MATRIX_ISA),
+    MATRIX_KERNEL(gemm),
+    MATRIX_KERNEL(gemm_tn),
+    MATRIX_KERNEL(transpose),
+    MATRIX_KERNEL(sum),
+    {MATRIX_KERNEL(add_vv), MATRIX_KERNEL(sub_vv), MATRIX_KERNEL(mul_vv), MATRIX_KERNEL(div_vv)},
+    {MATRIX_KERNEL(add_vs), MATRIX_KERNEL(sub_vs), MATRIX_KERNEL(mul_vs), MATRIX_KERNEL(div_vs)},
+    {MATRIX_KERNEL(add_sv), MATRIX_KERNEL(sub_sv), MATRIX_KERNEL(mul_sv), MATRIX_KERNEL(div_sv)},
+    {MATRIX_KERNEL(unm), MATRIX_KERNEL(abs), MATRIX_KERNEL(floor), MATRIX_KERNEL(ceil)},
+    {MATRIX_KERNEL(lt_vv), MATRIX_KERNEL(le_vv), MATRIX_KERNEL(gt_vv), MATRIX_KERNEL(ge_vv), MATRIX_KERNEL(eq_vv)},
+    {MATRIX_KERNEL(lt_vs), MATRIX_KERNEL(le_vs), MATRIX_KERNEL(gt_vs), MATRIX_KERNEL(ge_vs), MATRIX_KERNEL(eq_vs)},
+    MATRIX_KERNEL(select),
+    MATRIX_KERNEL(gather),
+    MATRIX_KERNEL(axpy),
+    MATRIX_KERNEL(dot_i8)
+};
+
+#undef MATRIX_ISA
+#undef MATRIX_KERNEL_ATTR
+#undef MATRIX_KERNEL_I8
@@ -51,3 +51,335 @@ assert((matrix.new{1,3, value=1} * err * matrix.new{3,1, value=1})[1] < 1e-5)
 m, m2 = matrix.fromtable{1,2, 3,4, rows=2, cols=2}:rref()
 assert(table.concat(m:totable(), ' ') == '1 0 0 1')
 assert(table.concat(m2:totable(), ' ') == '-2 1 1.5 -0.5')
+
+local r1, r2 = matrix.rng(42), matrix.rng(42)
+local u1, u2 = r1:uniform(10, 10), r2:uniform(10, 10)
+assert(table.concat(u1:totable(), ' ') == table.concat(u2:totable(), ' '))
+assert(table.concat(r1:normal(3, 3):totable(), ' ') ~= table.concat(u1:totable(), ' '))
+for i = 1, 100 do assert(u1[i] >= 0 and u1[i] < 1) end
+local m = matrix.new(5, 5)
+assert(r1:randint(m, 3, 7) == m)
+for i = 1, 25 do assert(m[i] >= 3 and m[i] <= 7 and m[i] == math.floor(m[i])) end
+assert(not pcall(r1.randint, r1, m, math.mininteger, math.maxinteger) and not pcall(r1.randint, r1, m, 2, 1))
+-- the stream position only depends on the number of drawn words:
+local s1, s2 = matrix.rng(7):stream(3), matrix.rng(7):stream(3)
+s1:uniform(4, 4)
+assert(s1:uniform(1, 1)[1] == s2:skip(16):uniform(1, 1)[1])
+local n = matrix.rng(1):normal(100, 100, 5, 2)
+local mean = matrix.new{1, 100, value=0.0001}:dot(n):dot(matrix.new{100, 1, value=1})[1]
+assert(math.abs(mean - 5) < 0.1)
+
+-- QR factorization against a random tall matrix, covering several panels:
+local r = matrix.rng(3)
+local a = r:uniform(120, 70, -1, 1)
+local qr = a:qr()
+local q = qr:Q()
+assert(q.rows == 120 and q.cols == 70 and qr.R.rows == 70 and qr.R.cols == 70)
+local function maxabs(m) local v = 0 for i = 1, m.rows*m.cols do v = math.max(v, math.abs(m[i])) end return v end
+assert(maxabs(q:dot(qr.R) - a) < 1e-4)
+assert(maxabs(q:tdot(q) - matrix.id(70)) < 1e-4)
+local x = r:uniform(70, 2)
+local b = a:dot(x)
+assert(maxabs(qr:solve(b) - x) < 1e-3)
+assert(maxabs(a:lstsq(b) - x) < 1e-3)
+assert(a:lstsq(b):dot(matrix.new{2, 1, value=1}).rows == 70)
+local rank1 = matrix.new{4, 2, value=1}
+assert(rank1:lstsq(matrix.new{4, 1, value=1}) == nil)
+
+-- conv2d against a naive cross-correlation with zero padding:
+local function xcorr(m, k, pr, pc, oh, ow, s)
+    local out = matrix.new(oh, ow)
+    for i = 1, oh do for j = 1, ow do
+        local acc = 0
+        for a = 1, k.rows do for b = 1, k.cols do
+            local r, c = (i-1)*s + a - pr, (j-1)*s + b - pc
+            if r >= 1 and r <= m.rows and c >= 1 and c <= m.cols then
+                acc = acc + m[{r, c}] * k[{a, b}]
+            end
+        end end
+        out[{i, j}] = acc
+    end end
+    return out
+end
+local img = r:uniform(13, 11)
+for _, ks in ipairs{3, 7} do -- direct and im2col paths
+    local k = r:uniform(ks, ks - 1)
+    local valid = img:conv2d(k)
+    assert(valid.rows == 13 - ks + 1 and valid.cols == 11 - ks + 2)
+    assert(maxabs(valid - xcorr(img, k, 0, 0, valid.rows, valid.cols, 1)) < 1e-4)
+    local same = img:conv2d(k, {mode="same", stride=2})
+    assert(same.rows == 7 and same.cols == 6)
+    assert(maxabs(same - xcorr(img, k, (ks-1)//2, (ks-2)//2, 7, 6, 2)) < 1e-4)
+    local full = img:conv2d(k, {mode="full", padding=1})
+    assert(maxabs(full - xcorr(img, k, ks, ks - 1, full.rows, full.cols, 1)) < 1e-4)
+end
+local flipped = matrix.fromtable{0,0,0, 0,0,1, 0,0,0, rows=3, cols=3}
+assert(maxabs(img:conv2d(flipped, {mode="same", flip=true})[{{2,13}}] - img[{{1,12}}]) < 1e-6)
+local chans = {img, img * 2}
+local outs = matrix.conv2d({chans, {img, img}}, {{flipped, flipped}, {r:uniform(3, 3), r:uniform(3, 3)}}, {mode="same"})
+assert(#outs == 2 and #outs[1] == 2 and outs[1][1].rows == 13)
+assert(maxabs(outs[1][1] - img:conv2d(flipped, {mode="same"}) * 3) < 1e-4)
+local big = {} for c = 1, 4 do big[c] = r:uniform(5, 4) end -- im2col with two channels
+local outs = matrix.conv2d(chans, {{big[1], big[2]}, {big[3], big[4]}})
+assert(maxabs(outs[2] - img:conv2d(big[3]) - (img * 2):conv2d(big[4])) < 1e-4)
+
+-- async operations: from a coroutine, resumed once the event loop sees the job done
+local a, b = r:uniform(60, 40), r:uniform(40, 30)
+local sq = r:uniform(20, 20) + matrix.id(20) * 20
+local results = {}
+local co = coroutine.create(function()
+    results.dot = a:dot_async(b)
+    results.lu = sq:lup_async()
+    results.inv = sq:inv_async()
+end)
+local ok, job = coroutine.resume(co)
+assert(ok and job:coroutine() == co)
+assert(type(matrix.async_fd()) == 'number')
+while coroutine.status(co) ~= 'dead' do
+    for _, done in ipairs(matrix.async_poll()) do
+        assert(done:done())
+        assert(coroutine.resume(done:coroutine()))
+    end
+end
+assert(maxabs(results.dot - a:dot(b)) < 1e-4)
+assert(math.abs(results.lu.det - sq:lup().det) < 1e-3 * math.abs(sq:lup().det))
+assert(maxabs(results.inv:dot(sq) - matrix.id(20)) < 1e-4)
+-- outside coroutines the job is returned
+local job = a:dot_async(b)
+assert(maxabs(job:wait() - a:dot(b)) < 1e-4 and job:done())
+assert(matrix.new(3, 3):lup_async():wait() == nil)
+-- more jobs than workers wait in the queue
+local jobs = {}
+for i = 1, 200 do jobs[i] = (a * i):dot_async(b) end
+for i = 200, 1, -1 do assert(maxabs(jobs[i]:wait() - a:dot(b) * i) < 1e-3 * i) end
+
+-- sharing (within the same lua_State here, but tokens are valid process wide)
+local model = r:uniform(5, 4)
+local values = table.concat(model:totable(), ' ')
+local token = model:share()
+local adopted = matrix.adopt(token)
+assert(table.concat(adopted:totable(), ' ') == values and not adopted.readonly)
+adopted[1] = 42
+assert(model[1] == 42 and model:share() == token)
+model:share(true)
+assert(model.readonly and adopted.readonly)
+assert(not pcall(function() adopted[2] = 1 end))
+assert(not pcall(function() adopted:rswap(1, 2) end))
+assert(pcall(function() adopted[{}] = 1 end) == false)
+assert((adopted + 1)[1] == 43 and not (adopted + 1).readonly)
+local born = matrix.new{2, 3, value=5, shared=true}
+local twin = matrix.adopt(born:share())
+twin[{2, 3}] = 7
+assert(born[{2, 3}] == 7 and born:sum() == 32 and born:share() == born:share())
+assert(not pcall(matrix.adopt, 2^53))
+
+-- copy on write: copies behave as independent matrices
+local orig = matrix.fromtable{1, 2, 3, 4, 5, 6, rows=2, cols=3}
+local copy, cols = orig[{}], orig[{nil, {2, 3}}]
+copy[1] = 10
+assert(orig[1] == 1 and copy[1] == 10 and cols[1] == 3)
+orig[{nil, 3}] = 0
+assert(cols[3] == 5 and cols[4] == 6 and copy[6] == 6)
+local again = cols[{}]
+cols:rswap(1, 2)
+assert(cols[1] == 4 and cols[2] == 3 and again[1] == 3 and orig[3] == 3)
+again:cswap(1, 2)
+assert(again[1] == 5 and again[3] == 3 and cols[3] == 6)
+copy:reshape(3, 2)
+assert(copy[{nil, 2}][1] == 4 and orig.rows == 2)
+r:uniform(copy)
+assert(orig[2] == 2 and orig[1] == 1)
+
+-- kernels: every tier available on this CPU gives the same results
+local best = matrix.cpu()
+local x, y = r:uniform(37, 45), r:uniform(45, 29)
+local rowv, colv = r:uniform(1, 45), r:uniform(37, 1)
+local ref = {x:dot(y), x:tdot(x), x:t(), x + rowv, colv - x, rowv * x, x / colv, -x, x:abs(), x:sum()}
+for _, tier in ipairs{'portable', 'sse2', 'neon', 'avx2', 'avx512', 'avx512vnni'} do
+    if pcall(matrix.cpu, tier) then
+        assert(matrix.cpu() == tier)
+        local got = {x:dot(y), x:tdot(x), x:t(), x + rowv, colv - x, rowv * x, x / colv, -x, x:abs(), x:sum()}
+        for i = 1, #ref - 1 do assert(maxabs(got[i] - ref[i]) < 1e-4) end
+        assert(math.abs(got[#ref] - ref[#ref]) < 1e-2)
+    end
+end
+matrix.cpu(best)
+assert(not pcall(matrix.cpu, 'mmx'))
+-- products by zero still propagate infinities and NaNs, and blocks of dot match the naive sum
+local inf = matrix.fromtable{math.huge}
+assert(inf:dot(matrix.new(1, 1))[1] ~= inf:dot(matrix.new(1, 1))[1] and inf:tdot(matrix.new(1, 1))[1] ~= inf:tdot(matrix.new(1, 1))[1])
+local ba, bb = r:uniform(300, 270), r:uniform(270, 2)
+local bd = ba:dot(bb)
+for i = 1, 300, 37 do
+    local s = 0
+    for l = 1, 270 do s = s + ba[{i, l}] * bb[{l, 2}] end
+    assert(math.abs(bd[{i, 2}] - s) < 1e-3)
+end
+-- broadcasting of row and column vectors
+local bm = matrix.fromtable{1, 2, 3, 4, 5, 6, rows=2, cols=3}
+local rv, cv = matrix.fromtable{10, 20, 30, rows=1, cols=3}, matrix.fromtable{100, 200, rows=2}
+assert(table.concat((bm + rv):totable(), ' ') == '11 12 23 24 35 36')
+assert(table.concat((rv - bm):totable(), ' ') == '9 8 17 16 25 24')
+assert(table.concat((cv * bm):totable(), ' ') == '100 400 300 800 500 1200')
+assert(table.concat((bm - cv):totable(), ' ') == '-99 -198 -97 -196 -95 -194')
+assert(bm:sum() == 21 and (bm:t())[2] == 3)
+
+-- masks
+local t = matrix.fromtable{1, -2, 3, 0/0, 5, -6, rows=2, cols=3}
+local pos = t:gt(0)
+assert(pos.rows == 2 and pos.cols == 3 and pos[1] and not pos[2] and not pos[4] and pos:count() == 3)
+assert(t:count(pos) == 3 and t:eq(t):count() == 5 and t:le(t):count() == 5)
+assert(table.concat(t:compress(pos):totable(), ' ') == '1 3 5')
+assert(t:compress(t:gt(10)) == nil)
+local clean = t[{}]:masked_fill_(~t:eq(t), 0)
+assert(clean[4] == 0 and t[4] ~= t[4])
+assert(table.concat(matrix.where(pos, t, 0):totable(), ' ') == '1 0 3 0 5 0')
+assert(table.concat(matrix.where(pos, 1, -1):totable(), ' ') == '1 -1 1 -1 1 -1')
+assert(((pos | t:lt(0)) ~ pos):count() == 2 and (pos & t:lt(0)):count() == 0)
+-- broadcasting with row and column vectors
+local bm = matrix.fromtable{1, 2, 3, 4, 5, 6, rows=2, cols=3}
+local above = bm:ge(matrix.fromtable{2, 3, 7, rows=1, cols=3})
+assert(table.concat(matrix.where(above, 1, 0):totable(), ' ') == '0 1 1 1 0 0')
+local rowmask = matrix.fromtable{1, 5, rows=2}:gt(2)
+assert(bm:count(rowmask) == 3 and table.concat(bm:compress(rowmask):totable(), ' ') == '2 4 6')
+assert(table.concat(bm:compress(matrix.fromtable{1, 0, 1, rows=1, cols=3}:eq(1)):totable(), ' ') == '1 2 5 6')
+bm:masked_fill_(rowmask, matrix.fromtable{10, 20, 30, rows=1, cols=3})
+assert(table.concat(bm:totable(), ' ') == '1 10 3 20 5 30')
+local big = r:uniform(3000, 3)
+assert(big:lt(0.5):count() + big:ge(0.5):count() == 9000)
+assert(maxabs(matrix.where(big:lt(0.5), big, 0.5) - matrix.where(big:ge(0.5), 0.5, big)) == 0)
+
+-- index vectors and permutations
+local src = matrix.fromtable{1, 2, 3, 4, 5, 6, rows=3, cols=2}
+local p = matrix.index{3, 1, 2}
+assert(#p == 3 and p[1] == 3 and table.concat(p:inverse():totable(), ' ') == '2 3 1')
+assert(table.concat(src:take_rows(p):totable(), ' ') == '3 1 2 6 4 5')
+assert(table.concat(src:take_rows{2, 2}:totable(), ' ') == '2 2 5 5')
+assert(table.concat(src:take_cols{2, 1, 2}:totable(), ' ') == '4 5 6 1 2 3 4 5 6')
+assert(maxabs(p:inverse():apply(p:apply(src)) - src) == 0)
+assert(not pcall(src.take_rows, src, {4}) and not pcall(matrix.index{1, 1}.inverse, matrix.index{1, 1}))
+local dst = matrix.new(3, 2)
+dst:scatter_rows_(p, src:take_rows(p))
+assert(maxabs(dst - src) == 0)
+local sq = r:uniform(30, 30)
+local lu, clu = sq:lup(), sq:lup(nil, true)
+assert(maxabs(clu.P:apply(sq) - lu.P:dot(sq)) < 1e-6)
+assert(maxabs(clu.P:inverse():apply(clu.L:dot(clu.U)) - sq) < 1e-4)
+local big = r:uniform(1000, 7)
+local shuffle = r:perm(1000)
+assert(#shuffle == 1000 and maxabs(shuffle:inverse():apply(big:take_rows(shuffle)) - big) == 0)
+local batch = r:perm(1000, 32)
+assert(#batch == 32 and big:take_rows(batch)[1] == big[batch[1]])
+local seen = {}
+for i = 1, #batch do assert(not seen[batch[i]]); seen[batch[i]] = true end
+
+-- slice objects and windows
+local grid = matrix.fromtable{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, rows=3, cols=4}
+local s = matrix.slice(2, 3, 2, 3)
+assert(table.concat(grid[s]:totable(), ' ') == table.concat(grid[{{2, 3}, {2, 3}}]:totable(), ' '))
+assert(table.concat(grid[matrix.slice(nil, nil, 4)]:totable(), ' ') == '10 11 12')
+assert(grid[matrix.slice(2)].rows == 2 and grid[matrix.slice(2)].cols == 4)
+local g2 = grid[{}]
+g2[s] = 0
+assert(g2[5] == 0 and g2[9] == 0 and grid[5] == 5 and g2[4] == 4)
+g2[s] = grid[s]
+assert(maxabs(g2 - grid) == 0)
+assert(not pcall(function() return grid[matrix.slice(1, 4)] end))
+local count, last, pos = 0
+for win, i, j in grid:window(2, 2) do
+    count = count + 1
+    assert(win[1] == grid[{i, j}] and win[4] == grid[{i + 1, j + 1}])
+    if count == 1 then last = win; pos = win[{}] end
+    assert(win == last)
+end
+assert(count == 6 and pos[1] == 1 and last[1] == 8)
+count = 0
+for win, i, j in grid:window(1, 2, {2, 2}) do count = count + 1; assert((i == 1 or i == 3) and (j == 1 or j == 3)) end
+assert(count == 4)
+
+-- 64 bit sizes
+local ok, err = pcall(matrix.new, 2^40, 2^40)
+assert(not ok and err:find('1099511627776*1099511627776', 1, true) and err:find('too big'))
+assert(not pcall(matrix.new, 2^62, 4))
+assert(not pcall(matrix.index, 2^62))
+assert(select(2, pcall(matrix.id, 0)):find('0*0', 1, true))
+local flat = matrix.new(6, 1)
+assert(not pcall(flat.reshape, flat, 2^40, 2^40) and flat.rows == 6)
+
+-- tiled matrices
+if matrix.tiled then
+    local a, b = r:uniform(13, 9), r:uniform(9, 11)
+    local ta, tb = matrix.tiled(nil, a, {tile=4, cache=3}), matrix.tiled(nil, b, {tile=4})
+    assert(ta.rows == 13 and ta.cols == 9 and ta.tile == 4 and maxabs(ta[{}] - a) == 0)
+    assert(maxabs(ta:dot(tb)[{}] - a:dot(b)) < 1e-5 and maxabs(ta:tdot(ta)[{}] - a:tdot(a)) < 1e-5)
+    assert(maxabs(ta:t()[{}] - a:t()) == 0 and maxabs((ta + ta)[{}] - (a + a)) == 0)
+    assert(maxabs((2 / ta)[{}] - 2 / a) < 1e-5 and maxabs((ta * 3)[{}] - a * 3) == 0)
+    assert(math.abs(ta:sum() - a:sum()) < 1e-4)
+    assert(ta[{2, 3}] == a[{2, 3}] and ta[20] == a[20])
+    assert(maxabs(ta[{{3, 10}, {2, 7}}] - a[{{3, 10}, {2, 7}}]) == 0)
+    ta[{{5, 8}, 5}] = 0
+    assert(ta[{6, 5}] == 0 and ta[{6, 6}] == a[{6, 6}])
+    assert(not pcall(function() return ta:dot(ta) end))
+    local c, d = r:uniform(21, 18), r:uniform(18, 23)
+    for _, cache in ipairs({1, 2, 5, 64}) do
+        local tc, td = matrix.tiled(nil, c, {tile=4, cache=cache}), matrix.tiled(nil, d, {tile=4, cache=cache})
+        assert(maxabs(tc:dot(td)[{}] - c:dot(d)) < 1e-4 and maxabs(tc:tdot(tc)[{}] - c:tdot(c)) < 1e-4)
+    end
+    local path = os.tmpname()
+    local tp = matrix.tiled(path, 5, 6, {tile=4})
+    tp[{}] = 1
+    tp[3] = 7
+    tp:sync()
+    local back = matrix.open_tiled(path, true)
+    assert(back.rows == 5 and back.cols == 6 and back.tile == 4 and back.readonly and back:sum() == 36)
+    assert(not pcall(function() back[1] = 2 end))
+    os.remove(path)
+end
+
+-- pairwise distances and nearest neighbours
+local pa, pb = r:uniform(300, 7), r:uniform(517, 7)
+local sq = matrix.cdist(pa, pb, {metric="sqeuclidean"})
+local ref = matrix.new(300, 517)
+for i = 1, 300 do for j = 1, 517 do
+    local s = 0
+    for k = 1, 7 do s = s + (pa[{i, k}] - pb[{j, k}])^2 end
+    ref[{i, j}] = s
+end end
+assert(maxabs(sq - ref) < 1e-4 and maxabs(matrix.cdist(pa, pb) - ref:sqrt()) < 1e-3)
+local cos = matrix.cdist(pa, pa, {metric="cosine"})
+local r3, r4 = pa[{3}], pa[{4}]
+assert(math.abs(cos[{3, 3}]) < 1e-5 and math.abs(cos[{3, 4}] - (1 - (r3 * r4):sum() / math.sqrt((r3 * r3):sum() * (r4 * r4):sum()))) < 1e-5)
+local dist, ids = matrix.topk(pa, pb, 5, {metric="sqeuclidean"})
+assert(dist.rows == 300 and dist.cols == 5 and #ids == 1500)
+for i = 1, 300, 7 do
+    local row = ref[{i}]:totable()
+    table.sort(row)
+    for l = 1, 5 do
+        assert(math.abs(dist[{i, l}] - row[l]) < 1e-4 and math.abs(ref[{i, ids[(i - 1) * 5 + l]}] - dist[{i, l}]) < 1e-4)
+    end
+end
+assert(pb:take_rows(ids).rows == 1500 and not pcall(matrix.topk, pa, pb, 518))
+
+-- int8 quantization
+if matrix.new(1, 1).quantize then
+    local w, x, bias = r:normal(70, 300), r:normal(300, 3), r:normal(70, 1)
+    local ref = w:dot(x) + bias
+    local tol = 0.03 * maxabs(ref)
+    for _, sym in ipairs{true, false} do
+        local q = w:quantize{symmetric=sym}
+        assert(q.rows == 70 and q.cols == 300 and q.axis == 1 and q.symmetric == sym)
+        assert(maxabs(q:dequantize() - w) < 0.05 and maxabs(q:dot(x, bias) - ref) < tol)
+        local qt = w:t():quantize{axis=2, symmetric=sym}
+        assert(maxabs(qt:tdot(x, bias) - ref) < tol and maxabs(qt:tdot(x) - w:dot(x)) < tol)
+        assert(not pcall(qt.dot, qt, x) and not pcall(q.dot, q, x:t()) and not pcall(q.dot, q, x, x))
+    end
+    local q = w:quantize()
+    local best, y = matrix.cpu(), q:dot(x)
+    for _, tier in ipairs{'portable', 'sse2', 'neon', 'avx2', 'avx512', 'avx512vnni'} do
+        if pcall(matrix.cpu, tier) then assert(maxabs(q:dot(x) - y) == 0) end -- integer products are exact
+    end
+    matrix.cpu(best)
+    local z = matrix.new(4, 5):quantize{symmetric=false}
+    assert(maxabs(z:dequantize()) == 0 and maxabs(z:dot(r:uniform(5, 1))) == 0)
+    assert(not pcall(w.quantize, w, {axis=3}))
+end